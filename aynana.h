@@ -0,0 +1,233 @@
+#pragma once
+
+// What a host sees of the engine: scripts compiled once and run many times,
+// the values they take and give back, memory tallies, scripts kept open for
+// editing, and the command-line front end.
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Memory accounting. Allocations are tallied by kind: tokens, every ast node
+// type, every data_* value type, and the scopes and call frames of a run.
+// The node and value kinds follow ast::ast_type in the same order.
+enum class mem_kind
+{
+	tokens,
+	operation,
+	ite,
+	for_loop,
+	whl_loop,
+	func,
+	call,
+	assign,
+	body,
+	symbol,
+	number,
+	string,
+	native,
+	data_num,
+	data_str,
+	data_obj,
+	data_vec,
+	data_rng,
+	data_arr,
+	data_chan,
+	scopes,
+	count
+};
+
+inline constexpr char const* mem_kind_names[] = {
+	"tokens", "operation", "ite", "for_loop", "whl_loop", "func", "call", "assign", "body",
+	"symbol", "number", "string", "native", "data_num", "data_str", "data_obj", "data_vec",
+	"data_rng", "data_arr", "data_chan", "scopes"
+};
+static_assert(std::size(mem_kind_names) == static_cast<size_t>(mem_kind::count), "a mem_kind has no name");
+
+struct mem_usage
+{
+	size_t live_bytes{ 0 };
+	size_t peak_bytes{ 0 };
+	size_t live_objects{ 0 };
+	size_t total_objects{ 0 };
+
+	void add(size_t bytes, size_t objects = 1)
+	{
+		live_bytes += bytes;
+		live_objects += objects;
+		total_objects += objects;
+		peak_bytes = std::max(peak_bytes, live_bytes);
+	}
+	void remove(size_t bytes, size_t objects = 1)
+	{
+		live_bytes -= bytes;
+		live_objects -= objects;
+	}
+};
+
+using mem_report = std::array<mem_usage, static_cast<size_t>(mem_kind::count)>;
+
+// Snapshot of the tokens and ast nodes of the whole process. Peaks are the
+// sum of the per-thread peaks.
+mem_report front_end_memory();
+
+// A script value copied out of, or into, a run's heap.
+struct value
+{
+	enum class kind
+	{
+		null,
+		number,
+		string,
+		list,
+		object
+	};
+
+	value() = default;
+	value(double n) : k(kind::number), num(n)
+	{
+	}
+	value(std::string s) : k(kind::string), text(std::move(s))
+	{
+	}
+	value(char const* s) : value(std::string(s))
+	{
+	}
+
+	static value list(std::vector<value> vs)
+	{
+		value res;
+		res.k = kind::list;
+		res.items = std::move(vs);
+		return res;
+	}
+	static value object(std::vector<std::pair<std::string, value>> fs)
+	{
+		value res;
+		res.k = kind::object;
+		res.fields = std::move(fs);
+		return res;
+	}
+
+	kind type() const
+	{
+		return k;
+	}
+	bool is_null() const
+	{
+		return k == kind::null;
+	}
+	double as_number() const
+	{
+		expect(kind::number);
+		return num;
+	}
+	std::string const& as_string() const
+	{
+		expect(kind::string);
+		return text;
+	}
+	std::vector<value> const& as_list() const
+	{
+		expect(kind::list);
+		return items;
+	}
+	std::vector<std::pair<std::string, value>> const& as_object() const
+	{
+		expect(kind::object);
+		return fields;
+	}
+	value const* field(std::string const& key) const
+	{
+		expect(kind::object);
+		for (auto& [name, v] : fields)
+		{
+			if (name == key) return &v;
+		}
+		return nullptr;
+	}
+
+private:
+	kind k{ kind::null };
+	double num{ 0 };
+	std::string text;
+	std::vector<value> items;
+	std::vector<std::pair<std::string, value>> fields;
+
+	void expect(kind want) const
+	{
+		if (k != want) throw std::runtime_error("value has another type");
+	}
+};
+
+// A script parsed and compiled once for the closure backend. It is immutable
+// after compile(), so any number of threads may run it at the same time;
+// every run gets a heap of its own and the result is copied out as a value.
+struct prepared_program
+{
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+	static std::shared_ptr<prepared_program const> compile(std::string_view source);
+	~prepared_program();
+
+	// Only a source that parses as a whole is compiled.
+	bool success() const;
+
+	// Where the parse stopped when success() is false: the offset of the
+	// first token it could not take. npos after a success.
+	size_t error_offset() const;
+
+	// Handle of a global the host may bind, npos when the script never
+	// refers to the name.
+	size_t global(std::string const& name) const;
+
+	// heap_limit is the run's memory budget; usage, when given, receives the
+	// run's memory tally, also when the budget aborts it. A run returns once
+	// the tasks it spawned have finished.
+	value run(std::vector<std::pair<size_t, value>> const& inputs = {}, size_t heap_limit = 0, mem_report* usage = nullptr) const;
+
+private:
+	struct compiled;
+	std::unique_ptr<compiled> impl;
+
+	prepared_program();
+};
+
+struct source_file;
+
+// A script kept open for editing; an edit only reparses the statements it
+// touches.
+struct script_editor
+{
+	explicit script_editor(std::string source);
+	~script_editor();
+	script_editor(script_editor const&) = delete;
+	script_editor& operator=(script_editor const&) = delete;
+
+	// Replaces `removed` characters at `offset` with `inserted`.
+	void edit(size_t offset, size_t removed, std::string_view inserted);
+	std::string const& source() const;
+
+	// Whether every statement parses.
+	bool success() const;
+
+	// The tree written out, empty when success() is false.
+	std::string tree() const;
+
+private:
+	std::unique_ptr<source_file> file;
+};
+
+// The tree a fresh parse of source gives written out, empty when it does
+// not parse. Like the command line, it keeps the statements before the
+// first one that does not parse.
+std::string parsed_tree(std::string_view source);
+
+// The aynana command line; see the README for its options.
+int aynana_main(int argc, char* argv[]);
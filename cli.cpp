@@ -0,0 +1,6 @@
+#include "aynana.h"
+
+int main(int argc, char* argv[])
+{
+	return aynana_main(argc, argv);
+}
@@ -1,21 +1,326 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <cstdint>
+#include <deque>
 #include <iostream>
+#include <iterator>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <new>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
-inline bool containes(std::string const& s, int c)
+#include "aynana.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define AYNANA_X86_SIMD
+#define AYNANA_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#include <immintrin.h>
+#include <intrin.h>
+#define AYNANA_X86_SIMD
+#define AYNANA_TARGET(isa)
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define AYNANA_MMAP
+#endif
+
+#if defined(__linux__) && !defined(AYNANA_NO_FIBERS)
+#include <ucontext.h>
+#define AYNANA_FIBERS
+#endif
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(AYNANA_NO_JIT)
+#define AYNANA_JIT
+#endif
+
+enum class char_class : uint8_t
+{
+	other,
+	space,
+	punct,
+	op0,
+	op1,
+	op2,
+	op3,
+	op4,
+	quote,
+	digit,
+	ident
+};
+
+constexpr std::array<char_class, 256> make_char_classes()
+{
+	std::array<char_class, 256> t{};
+	for (int c = 0; c < 256; ++c)
+	{
+		auto& k = t[static_cast<size_t>(c)];
+		if (c == ' ' || (c >= '\t' && c <= '\r')) k = char_class::space;
+		else if (c >= '0' && c <= '9') k = char_class::digit;
+		else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') k = char_class::ident;
+		else switch (c)
+		{
+		case '(': case ')': case '{': case '}': case ',': case ';': case '=': case ':': case '\\':
+			k = char_class::punct;
+			break;
+		case '&': case '|':
+			k = char_class::op0;
+			break;
+		case '<': case '>': case '~':
+			k = char_class::op1;
+			break;
+		case '+': case '-':
+			k = char_class::op2;
+			break;
+		case '*': case '/':
+			k = char_class::op3;
+			break;
+		case '.':
+			k = char_class::op4;
+			break;
+		case '\'': case '"':
+			k = char_class::quote;
+			break;
+		default:
+			break;
+		}
+	}
+	return t;
+}
+
+inline constexpr std::array<char_class, 256> char_classes = make_char_classes();
+
+inline char_class class_of(int c)
+{
+	return c == EOF ? char_class::other : char_classes[static_cast<unsigned char>(c)];
+}
+
+// Keywords are found with one probe: keyword_hash is collision free over
+// the keyword list, which the static_assert below checks at compile time.
+inline constexpr std::string_view keywords[] = { "if", "else", "for", "while", "par" };
+
+constexpr size_t keyword_hash(std::string_view s)
+{
+	return (static_cast<unsigned char>(s[0]) + 4 * s.size()) & 7;
+}
+
+struct keyword_table
+{
+	std::string_view slots[8]{};
+	bool perfect{ true };
+};
+
+constexpr keyword_table make_keyword_table()
+{
+	keyword_table t;
+	for (auto k : keywords)
+	{
+		auto& slot = t.slots[keyword_hash(k)];
+		if (!slot.empty()) t.perfect = false;
+		slot = k;
+	}
+	return t;
+}
+
+inline constexpr keyword_table keyword_slots = make_keyword_table();
+static_assert(keyword_slots.perfect, "keyword_hash collides, pick another mix");
+
+inline bool is_keyword(std::string_view s)
+{
+	return !s.empty() && keyword_slots.slots[keyword_hash(s)] == s;
+}
+
+// Identifiers are interned into dense ids by the lexer, so scopes, slots and
+// builtins are keyed by integers; id 0 is never a name. The names sit in
+// chunks that never move, so only interning takes the lock, not a lookup.
+inline constexpr size_t symbol_chunk_size = 1024;
+inline std::mutex symbol_lock;
+inline std::array<std::unique_ptr<std::string[]>, 4096> symbol_chunks = []
+{
+	std::array<std::unique_ptr<std::string[]>, 4096> chunks;
+	chunks[0] = std::make_unique<std::string[]>(symbol_chunk_size);
+	return chunks;
+}();
+inline uint32_t symbol_count{ 1 };
+inline std::unordered_map<std::string_view, uint32_t> symbol_ids{ { "", 0 } };
+
+inline uint32_t symbol_id(std::string_view name)
+{
+	std::lock_guard<std::mutex> guard(symbol_lock);
+	if (auto it = symbol_ids.find(name); it != std::end(symbol_ids))
+	{
+		return it->second;
+	}
+	auto const id = symbol_count;
+	auto& chunk = symbol_chunks.at(id / symbol_chunk_size);
+	if (chunk == nullptr) chunk = std::make_unique<std::string[]>(symbol_chunk_size);
+	auto& s = chunk[id % symbol_chunk_size];
+	s = name;
+	symbol_ids.emplace(s, id);
+	++symbol_count;
+	return id;
+}
+
+// An id reaches a thread after its name was stored, so the read is safe.
+inline std::string const& symbol_name(uint32_t id)
+{
+	return symbol_chunks[id / symbol_chunk_size][id % symbol_chunk_size];
+}
+
+// Front-end tally of one thread. Tokens and nodes are made by the parsing
+// thread, so each thread counts into its own block with plain loads and
+// stores; front_end_memory() sums the blocks, and a block is folded into
+// retired_front_end when its thread ends. Frees on another thread than the
+// allocation are fine: live counts are signed and only meaningful summed.
+struct front_end_tally
+{
+	struct counters
+	{
+		std::atomic<int64_t> live_bytes{ 0 };
+		std::atomic<int64_t> peak_bytes{ 0 };
+		std::atomic<int64_t> live_objects{ 0 };
+		std::atomic<int64_t> total_objects{ 0 };
+	};
+	std::array<counters, static_cast<size_t>(mem_kind::count)> kinds;
+
+	front_end_tally();
+	~front_end_tally();
+
+	void add(mem_kind k, int64_t bytes)
+	{
+		auto& c = kinds[static_cast<size_t>(k)];
+		auto const live = bump(c.live_bytes, bytes);
+		bump(c.live_objects, 1);
+		bump(c.total_objects, 1);
+		if (live > c.peak_bytes.load(std::memory_order_relaxed)) c.peak_bytes.store(live, std::memory_order_relaxed);
+	}
+	void remove(mem_kind k, int64_t bytes)
+	{
+		auto& c = kinds[static_cast<size_t>(k)];
+		bump(c.live_bytes, -bytes);
+		bump(c.live_objects, -1);
+	}
+
+	static int64_t bump(std::atomic<int64_t>& v, int64_t by)
+	{
+		auto const now = v.load(std::memory_order_relaxed) + by;
+		v.store(now, std::memory_order_relaxed);
+		return now;
+	}
+};
+
+inline std::mutex front_end_lock;
+inline std::vector<front_end_tally*> front_end_threads;
+inline mem_report retired_front_end;
+inline thread_local front_end_tally* this_thread_tally{ nullptr };
+
+inline front_end_tally::front_end_tally()
+{
+	std::lock_guard<std::mutex> guard(front_end_lock);
+	front_end_threads.push_back(this);
+	this_thread_tally = this;
+}
+
+inline front_end_tally::~front_end_tally()
+{
+	std::lock_guard<std::mutex> guard(front_end_lock);
+	for (size_t k = 0; k < kinds.size(); ++k)
+	{
+		auto& r = retired_front_end[k];
+		r.live_bytes += kinds[k].live_bytes.load();
+		r.peak_bytes += kinds[k].peak_bytes.load();
+		r.live_objects += kinds[k].live_objects.load();
+		r.total_objects += kinds[k].total_objects.load();
+	}
+	front_end_threads.erase(std::find(std::begin(front_end_threads), std::end(front_end_threads), this));
+	this_thread_tally = nullptr;
+}
+
+// Tally of the calling thread, made on first use; null once the thread is
+// shutting down, when nothing is counted any more.
+inline front_end_tally* front_end_usage()
+{
+	static thread_local front_end_tally block;
+	return this_thread_tally;
+}
+
+inline void front_end_add(mem_kind k, int64_t bytes)
+{
+	if (auto t = front_end_usage()) t->add(k, bytes);
+}
+
+inline void front_end_remove(mem_kind k, int64_t bytes)
+{
+	if (auto t = front_end_usage()) t->remove(k, bytes);
+}
+
+mem_report front_end_memory()
 {
-	return s.find(c) != std::string::npos;
+	std::lock_guard<std::mutex> guard(front_end_lock);
+	auto r = retired_front_end;
+	for (auto t : front_end_threads)
+	{
+		for (size_t k = 0; k < r.size(); ++k)
+		{
+			r[k].live_bytes += t->kinds[k].live_bytes.load();
+			r[k].peak_bytes += t->kinds[k].peak_bytes.load();
+			r[k].live_objects += t->kinds[k].live_objects.load();
+			r[k].total_objects += t->kinds[k].total_objects.load();
+		}
+	}
+	return r;
 }
 
+// Member that counts its owner as a live token; copies count as new tokens.
+template <typename Owner>
+struct tally_as_token
+{
+	tally_as_token()
+	{
+		front_end_add(mem_kind::tokens, sizeof(Owner));
+	}
+	tally_as_token(tally_as_token const&) : tally_as_token()
+	{
+	}
+	tally_as_token& operator=(tally_as_token const&) = default;
+	~tally_as_token()
+	{
+		front_end_remove(mem_kind::tokens, sizeof(Owner));
+	}
+};
+
 struct chars_in_file
 {
 	int ch{ 0 };
+	size_t pos{ 0 };
 
-	chars_in_file(std::ifstream& f) : file(f)
+	chars_in_file(std::istream& f) : file(&f)
+	{
+	}
+	chars_in_file(std::string_view src, size_t from) : pos(from), text(src)
 	{
 	}
 
@@ -23,18 +328,23 @@ struct chars_in_file
 	{
 		if (ch != EOF)
 		{
-			ch = file.get();
+			ch = file != nullptr ? file->get()
+				: pos < text.size() ? static_cast<unsigned char>(text[pos]) : EOF;
+			if (ch != EOF) ++pos;
 		}
 		return ch;
 	}
 
 	void put_back()
 	{
-		file.putback(ch);
+		if (ch == EOF) return;
+		if (file != nullptr) file->putback(static_cast<char>(ch));
+		--pos;
 	}
 
 private:
-	std::ifstream& file;
+	std::istream* file{ nullptr };
+	std::string_view text;
 };
 
 struct token
@@ -42,6 +352,10 @@ struct token
 	std::string ch;
 	std::string data;
 	struct ast* n{ nullptr };
+	size_t begin{ 0 };
+	size_t end{ 0 };
+	uint32_t sym_id{ 0 };
+	tally_as_token<token> tally{};
 
 	std::pair<std::string, std::string> operator()() const
 	{
@@ -72,12 +386,14 @@ struct lex
 		return res;
 	}
 
-	std::string scan(int i, int(*is_valid)(int), int valid_ch = EOF) const
+	std::string scan(int i, char_class a, char_class b, int valid_ch = EOF) const
 	{
 		std::string res;
 		res += i;
-		while ((is_valid(chars()) || chars.ch == valid_ch) && chars.ch != EOF)
+		for (;;)
 		{
+			auto const k = class_of(chars());
+			if (k != a && k != b && (chars.ch != valid_ch || chars.ch == EOF)) break;
 			res += chars.ch;
 		}
 		chars.put_back();
@@ -89,37 +405,58 @@ struct lex
 		if (chars.ch != EOF)
 		{
 			chars();
-			while (isspace(chars.ch) || chars.ch == '\t') chars();
-			auto c = chars.ch;
+			while (class_of(chars.ch) == char_class::space) chars();
+			auto const begin = chars.ch == EOF ? chars.pos : chars.pos - 1;
+			auto t = classify(chars.ch);
+			t.begin = begin;
+			t.end = chars.pos;
+			return t;
+		}
+		return {};
+	}
 
-			if (containes("(){},;=:\\", c)) return { {static_cast<char>(c)}, "" };
-			if (c == '&' || c == '|') return { "operation0", {static_cast<char>(c)} };
-			if (c == '<' || c == '>' || c == '~') return { "operation1", {static_cast<char>(c)} };
-			if (c == '+' || c == '-') return { "operation2", {static_cast<char>(c)} };
-			if (c == '*' || c == '/') return { "operation3", {static_cast<char>(c)} };
-			if (c == '.') return { "operation4", {static_cast<char>(c)} };
-			if (c == '\'' || c == '"') return { "string", scan_str(c) };
-			if (isdigit(c)) return { "number", scan(c, isdigit, '.') };
-			if (isalpha(c) || c == '_')
+	token classify(int c) const
+	{
+		auto const one = std::string(1, static_cast<char>(c));
+		switch (class_of(c))
+		{
+		case char_class::punct: return { one, "" };
+		case char_class::op0: return { "operation0", one };
+		case char_class::op1: return { "operation1", one };
+		case char_class::op2: return { "operation2", one };
+		case char_class::op3: return { "operation3", one };
+		case char_class::op4: return { "operation4", one };
+		case char_class::quote: return { "string", scan_str(c) };
+		case char_class::digit: return { "number", scan(c, char_class::digit, char_class::digit, '.') };
+		case char_class::ident:
 			{
-				auto const& data = scan(c, isalnum, '_');
-				return data == "if" || data == "else" || data == "for" || data == "while"
-					? token{ data, "" }
-				: token{ "symbol", data };
+				auto data = scan(c, char_class::ident, char_class::digit);
+				if (is_keyword(data)) return { data, "" };
+				token t{ "symbol", data };
+				t.sym_id = symbol_id(t.data);
+				return t;
 			}
+		default:
+			return {};
 		}
-		return {};
 	}
 };
 
 
 struct lex_buff
 {
-	lex& l;
-	lex_buff(lex& lexer) : l(lexer)
+	lex* l;
+	lex_buff(lex& lexer) : l(&lexer)
 	{
 	}
+	// Reads the tokens [first, last) of ts, then end of input.
+	lex_buff(std::vector<token> const& ts, size_t first, size_t last) : l(nullptr)
+	{
+		buffer.insert(std::end(buffer), std::make_reverse_iterator(std::begin(ts) + last), std::make_reverse_iterator(std::begin(ts) + first));
+	}
 	std::vector<token> buffer;
+	// The script the tokens are lexed from, kept only by lazy parses.
+	std::shared_ptr<std::string const> text;
 	token operator()()
 	{
 		token t;
@@ -128,9 +465,9 @@ struct lex_buff
 			t = buffer.back();
 			buffer.pop_back();
 		}
-		else
+		else if (l != nullptr)
 		{
-			t = l();
+			t = (*l)();
 		}
 		return t;
 	}
@@ -146,6 +483,73 @@ struct lex_buff
 
 
 
+// Growable output buffer that the serializers write into. When bound to a
+// sink it hands data over in large blocks, only when full or on flush().
+struct out_buffer
+{
+	out_buffer() = default;
+	explicit out_buffer(std::ostream& out, size_t flush_at = 1 << 20) : sink(&out), limit(flush_at)
+	{
+		buf.reserve(limit);
+	}
+	out_buffer(out_buffer const&) = delete;
+	out_buffer& operator=(out_buffer const&) = delete;
+	~out_buffer()
+	{
+		flush();
+	}
+
+	out_buffer& operator<<(char c)
+	{
+		buf += c;
+		return spill();
+	}
+	out_buffer& operator<<(std::string_view s)
+	{
+		buf.append(s.data(), s.size());
+		return spill();
+	}
+	// Whole numbers in plain digits, others in the shortest form that reads
+	// back the same.
+	out_buffer& operator<<(double n)
+	{
+		char tmp[32];
+		bool const whole = std::floor(n) == n && std::fabs(n) < 1e21;
+		auto const res = whole ? std::to_chars(tmp, tmp + sizeof(tmp), n, std::chars_format::fixed) : std::to_chars(tmp, tmp + sizeof(tmp), n);
+		buf.append(tmp, res.ptr);
+		return spill();
+	}
+
+	void flush()
+	{
+		if (sink != nullptr && !buf.empty())
+		{
+			sink->write(buf.data(), static_cast<std::streamsize>(buf.size()));
+			sink->flush();
+			buf.clear();
+		}
+	}
+	size_t size() const
+	{
+		return buf.size();
+	}
+	std::string take()
+	{
+		return std::move(buf);
+	}
+
+private:
+	std::string buf;
+	std::ostream* sink{ nullptr };
+	size_t limit{ 0 };
+
+	out_buffer& spill()
+	{
+		if (sink != nullptr && buf.size() >= limit) flush();
+		return *this;
+	}
+};
+
 struct ast
 {
 	enum class ast_type
@@ -161,54 +565,95 @@ struct ast
 		symbol,
 		number,
 		string,
+		native,
 		data_num,
 		data_str,
 		data_obj,
-		data_vec
+		data_vec,
+		data_rng,
+		data_arr,
+		data_chan
 	} type;
 
-	ast(ast_type tp) : type(tp)
+	// Nodes are tallied under their mem_kind with the size of their own type;
+	// data values pass 0 and are tallied by the heap that owns them instead.
+	ast(ast_type tp, size_t bytes) : type(tp), tallied_bytes(static_cast<uint32_t>(bytes))
+	{
+		if (tallied_bytes != 0) front_end_add(kind(), tallied_bytes);
+	}
+	ast(ast const& o) : ast(o.type, o.tallied_bytes)
+	{
+	}
+
+	virtual void write(out_buffer& out) = 0;
+	virtual ~ast()
 	{
+		if (tallied_bytes != 0) front_end_remove(kind(), tallied_bytes);
 	}
 
-	virtual std::string to_string() = 0;
-	virtual ~ast() = default;
+	mem_kind kind() const
+	{
+		return static_cast<mem_kind>(static_cast<size_t>(type) + 1);
+	}
+
+	std::string to_string()
+	{
+		out_buffer out;
+		write(out);
+		return out.take();
+	}
+
+	// Owned by an ast_pool and possibly pointed at by several parents.
+	bool pooled{ false };
+
+private:
+	uint32_t tallied_bytes{ 0 };
 };
 
+static_assert(static_cast<size_t>(mem_kind::data_chan) == static_cast<size_t>(ast::ast_type::data_chan) + 1, "mem_kind must follow ast::ast_type");
+
 struct sym : ast
 {
 	std::string s;
-	sym(std::string const& s_) : ast(ast_type::symbol), s(s_)
+	uint32_t sym_id;
+	sym(std::string const& s_, uint32_t id = 0) : ast(ast_type::symbol, sizeof(sym)), s(s_), sym_id(id)
 	{
 	}
-	std::string to_string() override
+	void write(out_buffer& out) override
 	{
-		return s;
+		out << s;
 	}
 };
 
 struct num : ast
 {
 	std::string n;
-	num(std::string const& s_) : ast(ast_type::number), n(s_)
+	num(std::string const& s_) : ast(ast_type::number, sizeof(num)), n(s_)
 	{
 	}
-	std::string to_string() override
+	void write(out_buffer& out) override
 	{
-		return n;
+		out << n;
 	}
 };
 
 struct str : ast
 {
 	std::string s;
-	str(std::string const& s_) : ast(ast_type::string), s(s_)
+	str(std::string const& s_) : ast(ast_type::string, sizeof(str)), s(s_)
 	{
 	}
-	std::string to_string() override
+	~str() override;
+	void write(out_buffer& out) override
 	{
-		return s;
+		out << s;
 	}
+	struct data_str* value();
+
+private:
+	// the literal as a value: made on first use, belongs to no heap and is
+	// freed with the node, so it lives as long as the tree holding it
+	std::atomic<struct data_str*> interned{ nullptr };
 };
 
 struct operation : ast
@@ -216,12 +661,17 @@ struct operation : ast
 	std::string op;
 	ast* l;
 	ast* r;
-	operation(std::string const& o, ast* left, ast* right = nullptr) : ast(ast_type::operation), op(o), l(left), r(right)
+	std::atomic<uint64_t> ic{ 0 };
+	operation(std::string const& o, ast* left, ast* right = nullptr) : ast(ast_type::operation, sizeof(operation)), op(o), l(left), r(right)
 	{
 	}
-	std::string to_string() override
+	void write(out_buffer& out) override
 	{
-		return "{ operation\n" + op + "\n" + l->to_string() + "\n" + r->to_string() + "\n}";
+		out << "{ operation\n" << op << '\n';
+		l->write(out);
+		out << '\n';
+		r->write(out);
+		out << "\n}";
 	}
 };
 
@@ -230,26 +680,41 @@ struct ITE : ast
 	ast* p;
 	ast* t;
 	ast* e;
-	ITE(ast* prop, ast* then, ast* else_) : ast(ast_type::ite), p(prop), t(then), e(else_)
+	ITE(ast* prop, ast* then, ast* else_) : ast(ast_type::ite, sizeof(ITE)), p(prop), t(then), e(else_)
 	{
 	}
-	std::string to_string() override
+	void write(out_buffer& out) override
 	{
-		return "{ if\n" + p->to_string() + "\n" + "then\n" + t->to_string() + (e != nullptr ? "\n" + e->to_string() : "") + "\n}";
+		out << "{ if\n";
+		p->write(out);
+		out << "\nthen\n";
+		t->write(out);
+		if (e != nullptr)
+		{
+			out << '\n';
+			e->write(out);
+		}
+		out << "\n}";
 	}
 };
 
 struct for_loop : ast
 {
 	std::string i;
+	uint32_t sym_id;
 	ast* rng;
 	ast* b;
-	for_loop(std::string const& it, ast* range, ast* body_) : ast(ast_type::for_loop), i(it), rng(range), b(body_)
+	bool parallel{ false };
+	for_loop(std::string const& it, uint32_t sid, ast* range, ast* body_) : ast(ast_type::for_loop, sizeof(for_loop)), i(it), sym_id(sid), rng(range), b(body_)
 	{
 	}
-	std::string to_string() override
+	void write(out_buffer& out) override
 	{
-		return "{ for\n" + i + "\n" + rng->to_string() + "\n" + b->to_string() + "\n}";
+		out << (parallel ? "{ par for\n" : "{ for\n") << i << '\n';
+		rng->write(out);
+		out << '\n';
+		b->write(out);
+		out << "\n}";
 	}
 };
 
@@ -257,47 +722,117 @@ struct whl_loop : ast
 {
 	ast* p;
 	ast* b;
-	whl_loop(ast* prop, ast* body_) : ast(ast_type::whl_loop), p(prop), b(body_)
+	whl_loop(ast* prop, ast* body_) : ast(ast_type::whl_loop, sizeof(whl_loop)), p(prop), b(body_)
 	{
 	}
-	std::string to_string() override
+	void write(out_buffer& out) override
 	{
-		return "{ while\n" + p->to_string() + "\n" + b->to_string() + "\n}";
+		out << "{ while\n";
+		p->write(out);
+		out << '\n';
+		b->write(out);
+		out << "\n}";
 	}
 };
 
 struct body_ : ast
 {
 	std::vector<ast*> stmts;
-	body_() : ast(ast_type::body)
+	body_() : ast(ast_type::body, sizeof(body_))
 	{
 	}
-	std::string to_string() override
+	void write(out_buffer& out) override
 	{
-		std::string res;
-		for (auto stmt : stmts)
+		out << "[\n";
+		for (size_t i = 0; i < stmts.size(); ++i)
 		{
-			res += (res.empty() ? "" : "\n") + stmt->to_string();
+			if (i != 0) out << '\n';
+			stmts[i]->write(out);
 		}
-		return "[\n" + res + "\n]";
+		out << "\n]";
+	}
+};
+
+struct num_kernel;
+
+// Types seen by the calls of a func: one bit per ast_type, plus bit 0 for
+// null, for each of the first max_args arguments and for the result. A func
+// that gets hot while only ever seeing numbers is given a num_kernel.
+struct type_feedback
+{
+	static constexpr size_t max_args = 4;
+	static constexpr uint32_t hot_calls = 64;
+
+	enum class state
+	{
+		profiling,
+		compiled,
+		generic
+	};
+
+	std::atomic<uint32_t> calls{ 0 };
+	std::atomic<uint32_t> args[max_args]{};
+	std::atomic<uint32_t> result{ 0 };
+	std::atomic<state> status{ state::profiling };
+
+	static uint32_t bit(ast* v)
+	{
+		return v == nullptr ? 1u : 2u << static_cast<uint32_t>(v->type);
 	}
+	static void note(std::atomic<uint32_t>& seen, ast* v)
+	{
+		auto const b = bit(v);
+		if ((seen.load(std::memory_order_relaxed) & b) == 0) seen.fetch_or(b, std::memory_order_relaxed);
+	}
+};
+
+struct par;
+struct ast_pool;
+
+// A lambda body that was only pre-parsed, from its '{' to its '}', and the
+// rule that builds it on the first call. It is kept as a range of the script
+// when the parse has the text, else as its tokens.
+struct lazy_source
+{
+	std::shared_ptr<std::string const> text;
+	size_t begin{ 0 };
+	size_t end{ 0 };
+	std::vector<token> tokens;
+	std::vector<uint32_t> names;
+	par const* rule{ nullptr };
+	std::shared_ptr<ast_pool> pool;
+	std::once_flag once;
+	std::atomic<bool> parsed{ false };
+
+	ast* parse() const;
 };
 
 struct func : ast
 {
 	std::vector<std::string> as;
+	std::vector<uint32_t> sym_ids;
 	ast* b;
-	func(ast* body_ = nullptr) : ast(ast_type::func), b(body_)
+	std::unique_ptr<lazy_source> lazy;
+	type_feedback profile;
+	std::atomic<num_kernel*> kernel{ nullptr };
+	func(ast* body_ = nullptr) : ast(ast_type::func, sizeof(func)), b(body_)
 	{
 	}
-	std::string to_string() override
+	~func() override;
+	// b, parsed first if the body was only pre-parsed.
+	ast* body();
+	void write(out_buffer& out) override
 	{
-		std::string args;
-		for (auto a : as)
+		out << "{ func\n[";
+		for (size_t i = 0; i < as.size(); ++i)
 		{
-			args += (args.empty() ? "" : ", ") + a;
+			if (i != 0) out << ", ";
+			out << as[i];
 		}
-		return "{ func\n[" + args + "]\n" + (b == nullptr ? "[]" : b->to_string()) + "\n}";
+		out << "]\n";
+		if (body() == nullptr) out << "[]";
+		else b->write(out);
+		out << "\n}";
 	}
 };
 
@@ -305,122 +840,388 @@ struct call_ : ast
 {
 	std::vector<ast*> as;
 	ast* src{ nullptr };
-	call_() : ast(ast_type::call)
+	call_() : ast(ast_type::call, sizeof(call_))
 	{
 	}
-	std::string to_string() override
+	void write(out_buffer& out) override
 	{
-		std::string args;
+		out << "{ call\n";
+		src->write(out);
+		out << "\n[";
 		for (auto a : as)
 		{
-			args += "\n" + a->to_string();
+			out << '\n';
+			a->write(out);
 		}
-		return "{ call\n" + src->to_string() + "\n[" + args + "\n]\n}";
+		out << "\n]\n}";
 	}
 };
 
 struct assign : ast
 {
 	std::string id;
+	uint32_t sym_id;
 	ast* v;
-	assign(std::string const& identifier, ast* val) : ast(ast_type::assign), id(identifier), v(val)
+	assign(std::string const& identifier, uint32_t sid, ast* val) : ast(ast_type::assign, sizeof(assign)), id(identifier), sym_id(sid), v(val)
 	{
 	}
-	std::string to_string() override
+	void write(out_buffer& out) override
 	{
-		return "{ assign\n" + id + "\n" + v->to_string() + "\n}";
+		out << "{ assign\n" << id << '\n';
+		v->write(out);
+		out << "\n}";
 	}
 };
 
 
-struct par_res
+template <typename F>
+void visit_children(ast* n, F&& f)
 {
-	bool success;
-	std::vector<struct ast*> result;
-};
+	auto visit = [&f](ast* c)
+	{
+		if (c != nullptr) f(c);
+	};
+	switch (n->type)
+	{
+	case ast::ast_type::operation:
+		visit(reinterpret_cast<operation*>(n)->l);
+		visit(reinterpret_cast<operation*>(n)->r);
+		break;
+	case ast::ast_type::ite:
+		visit(reinterpret_cast<ITE*>(n)->p);
+		visit(reinterpret_cast<ITE*>(n)->t);
+		visit(reinterpret_cast<ITE*>(n)->e);
+		break;
+	case ast::ast_type::for_loop:
+		visit(reinterpret_cast<for_loop*>(n)->rng);
+		visit(reinterpret_cast<for_loop*>(n)->b);
+		break;
+	case ast::ast_type::whl_loop:
+		visit(reinterpret_cast<whl_loop*>(n)->p);
+		visit(reinterpret_cast<whl_loop*>(n)->b);
+		break;
+	case ast::ast_type::body:
+		for (auto stmt : reinterpret_cast<body_*>(n)->stmts) visit(stmt);
+		break;
+	case ast::ast_type::func:
+		visit(reinterpret_cast<func*>(n)->b);
+		break;
+	case ast::ast_type::call:
+		visit(reinterpret_cast<call_*>(n)->src);
+		for (auto a : reinterpret_cast<call_*>(n)->as) visit(a);
+		break;
+	case ast::ast_type::assign:
+		visit(reinterpret_cast<assign*>(n)->v);
+		break;
+	default:
+		break;
+	}
+}
 
-struct par
+// Frees n unless its pool owns it.
+inline void free_node(ast* n)
 {
-	static lex_buff* lex_b;
-	static std::vector<par*> all_parsers;
-
-	std::string id{};
+	if (!n->pooled) delete n;
+}
 
-	virtual par_res operator()()
+// Frees root and everything below it; shared subtrees are freed once and
+// pooled ones are left to their pool.
+inline void delete_tree(ast* root)
+{
+	std::vector<ast*> pending{ root };
+	std::unordered_set<ast*> seen;
+	while (!pending.empty())
 	{
-		return { false,{} };
+		auto n = pending.back();
+		pending.pop_back();
+		if (n != nullptr && !n->pooled && seen.insert(n).second)
+		{
+			visit_children(n, [&pending](ast* c) { pending.push_back(c); });
+		}
+	}
+	for (auto n : seen)
+	{
+		delete n;
 	}
+}
 
-	static void remove_all()
+// Deep copy of a parsed tree, for passes that duplicate code.
+inline ast* clone_tree(ast* n)
+{
+	if (n == nullptr) return nullptr;
+	switch (n->type)
 	{
-		for (auto p : all_parsers)
+	case ast::ast_type::operation:
+		{
+			auto o = reinterpret_cast<operation*>(n);
+			return new operation(o->op, clone_tree(o->l), clone_tree(o->r));
+		}
+	case ast::ast_type::ite:
+		{
+			auto c = reinterpret_cast<ITE*>(n);
+			return new ITE(clone_tree(c->p), clone_tree(c->t), clone_tree(c->e));
+		}
+	case ast::ast_type::for_loop:
+		{
+			auto fr = reinterpret_cast<for_loop*>(n);
+			auto res = new for_loop(fr->i, fr->sym_id, clone_tree(fr->rng), clone_tree(fr->b));
+			res->parallel = fr->parallel;
+			return res;
+		}
+	case ast::ast_type::whl_loop:
+		{
+			auto w = reinterpret_cast<whl_loop*>(n);
+			return new whl_loop(clone_tree(w->p), clone_tree(w->b));
+		}
+	case ast::ast_type::body:
+		{
+			auto res = new body_();
+			for (auto stmt : reinterpret_cast<body_*>(n)->stmts)
+			{
+				res->stmts.push_back(clone_tree(stmt));
+			}
+			return res;
+		}
+	case ast::ast_type::func:
+		{
+			auto f = reinterpret_cast<func*>(n);
+			auto res = new func(clone_tree(f->body()));
+			res->as = f->as;
+			res->sym_ids = f->sym_ids;
+			return res;
+		}
+	case ast::ast_type::call:
+		{
+			auto c = reinterpret_cast<call_*>(n);
+			auto res = new call_();
+			res->src = clone_tree(c->src);
+			for (auto a : c->as)
+			{
+				res->as.push_back(clone_tree(a));
+			}
+			return res;
+		}
+	case ast::ast_type::assign:
 		{
-			delete p;
+			auto a = reinterpret_cast<assign*>(n);
+			return new assign(a->id, a->sym_id, clone_tree(a->v));
 		}
-		all_parsers.clear();
+	case ast::ast_type::symbol:
+		return new sym(reinterpret_cast<sym*>(n)->s, reinterpret_cast<sym*>(n)->sym_id);
+	case ast::ast_type::number:
+		return new num(reinterpret_cast<num*>(n)->n);
+	case ast::ast_type::string:
+		return new str(reinterpret_cast<str*>(n)->s);
+	default:
+		return n;
 	}
-};
-lex_buff* par::lex_b{ nullptr };
-std::vector<par*> par::all_parsers;
+}
 
-struct atom : par
+// Hash-consing table of one parse. Structurally equal symbols, literals and
+// operations over pooled operands share a single node, owned by the pool and
+// not by the trees pointing at it, so a pass must copy a pooled node before
+// changing it. Equal subtrees are the same pointer, so results may be cached
+// per node. The parser callbacks intern into the pool in use on their thread.
+struct ast_pool : std::enable_shared_from_this<ast_pool>
 {
-	std::string sym;
-	bool has_cb{ false };
-	std::function<void(std::vector<ast*>&, token&)> cb;
-	atom(std::string const& s) : sym(s)
-	{
-		id = s;
-		all_parsers.push_back(this);
-	}
-	atom(std::string const& s, std::function<void(std::vector<ast*>&, token&)> on_success) : sym(s), has_cb(true), cb(on_success)
-	{
-		id = s;
-		all_parsers.push_back(this);
-	}
-	par_res operator()() override
+	enum kind_index { symbols, numbers, strings, operations, kinds };
+	struct counts
 	{
-		auto t = (*lex_b)();
-		par_res res{ t.ch == sym, {} };
+		size_t nodes{ 0 };
+		size_t unique{ 0 };
+	};
 
-		if (res.success)
+	static inline thread_local ast_pool* current{ nullptr };
+
+	// Makes pool the one in use on this thread while the guard lives.
+	struct use
+	{
+		ast_pool* saved;
+		explicit use(ast_pool* pool) : saved(current)
 		{
-			if (has_cb) cb(res.result, t);
+			current = pool;
 		}
-		else
+		use(use const&) = delete;
+		use& operator=(use const&) = delete;
+		~use()
 		{
-			(*lex_b).push(t);
+			current = saved;
 		}
-		return res;
-	}
-};
+	};
 
-struct all : par
-{
-	std::vector<par*> ps;
-	std::function<void(std::vector<ast*>&)> cb;
-	bool has_cb{ false };
-	all(std::initializer_list<par*> p) : ps(p)
+	ast_pool() = default;
+	ast_pool(ast_pool const&) = delete;
+	ast_pool& operator=(ast_pool const&) = delete;
+	~ast_pool()
 	{
-		all_parsers.push_back(this);
+		for (auto& [k, n] : table)
+		{
+			delete n;
+		}
 	}
-	all(std::initializer_list<par*> p, std::function<void(std::vector<ast*>&)> on_success) : ps(p), cb(on_success), has_cb(true)
+
+	// n, or the pooled node equal to it, in which case n is freed.
+	static ast* intern(ast* n)
 	{
-		all_parsers.push_back(this);
+		return current != nullptr ? current->add(n) : n;
 	}
-	par_res operator()() override
+
+	std::array<counts, kinds> stats() const
 	{
-		par_res res{ true, {} };
+		std::lock_guard<std::mutex> guard(lock);
+		return tally;
+	}
+
+private:
+	// Views into the pooled node's own strings.
+	struct key
+	{
+		ast::ast_type type;
+		std::string_view text;
+		uint32_t id;
+		ast const* l;
+		ast const* r;
+		bool operator==(key const& o) const
+		{
+			return type == o.type && id == o.id && l == o.l && r == o.r && text == o.text;
+		}
+	};
+	struct key_hash
+	{
+		size_t operator()(key const& k) const
+		{
+			auto h = std::hash<std::string_view>()(k.text) ^ (static_cast<size_t>(k.type) << 48) ^ k.id;
+			h = h * 31 + std::hash<ast const*>()(k.l);
+			return h * 31 + std::hash<ast const*>()(k.r);
+		}
+	};
+
+	mutable std::mutex lock;
+	std::unordered_map<key, ast*, key_hash> table;
+	std::array<counts, kinds> tally{};
+
+	static key key_of(ast* n, kind_index& k)
+	{
+		switch (n->type)
+		{
+		case ast::ast_type::symbol:
+			k = symbols;
+			return { n->type, reinterpret_cast<sym*>(n)->s, reinterpret_cast<sym*>(n)->sym_id, nullptr, nullptr };
+		case ast::ast_type::number:
+			k = numbers;
+			return { n->type, reinterpret_cast<num*>(n)->n, 0, nullptr, nullptr };
+		case ast::ast_type::string:
+			k = strings;
+			return { n->type, reinterpret_cast<str*>(n)->s, 0, nullptr, nullptr };
+		default:
+			k = operations;
+			return { n->type, reinterpret_cast<operation*>(n)->op, 0, reinterpret_cast<operation*>(n)->l, reinterpret_cast<operation*>(n)->r };
+		}
+	}
+
+	ast* add(ast* n)
+	{
+		if (n->type == ast::ast_type::operation)
+		{
+			auto o = reinterpret_cast<operation*>(n);
+			if (o->l == nullptr || o->r == nullptr || !o->l->pooled || !o->r->pooled) return n;
+		}
+		kind_index k;
+		auto const id = key_of(n, k);
+		std::lock_guard<std::mutex> guard(lock);
+		++tally[k].nodes;
+		auto [it, fresh] = table.try_emplace(id, n);
+		if (!fresh)
+		{
+			delete n;
+			return it->second;
+		}
+		++tally[k].unique;
+		n->pooled = true;
+		return n;
+	}
+};
+
+struct par_res
+{
+	bool success;
+	std::vector<struct ast*> result;
+};
+
+struct par
+{
+	std::string id{};
+
+	virtual par_res operator()(lex_buff&) const
+	{
+		return { false,{} };
+	}
+
+	virtual void children(std::vector<par*>&) const
+	{
+	}
+
+	virtual ~par() = default;
+};
+
+struct atom : par
+{
+	std::string sym;
+	bool has_cb{ false };
+	std::function<void(std::vector<ast*>&, token&)> cb;
+	atom(std::string const& s) : sym(s)
+	{
+		id = s;
+	}
+	atom(std::string const& s, std::function<void(std::vector<ast*>&, token&)> on_success) : sym(s), has_cb(true), cb(on_success)
+	{
+		id = s;
+	}
+	par_res operator()(lex_buff& lb) const override
+	{
+		auto t = lb();
+		par_res res{ t.ch == sym, {} };
+
+		if (res.success)
+		{
+			if (has_cb) cb(res.result, t);
+		}
+		else
+		{
+			lb.push(t);
+		}
+		return res;
+	}
+};
+
+struct all : par
+{
+	std::vector<par*> ps;
+	std::function<void(std::vector<ast*>&)> cb;
+	bool has_cb{ false };
+	all(std::initializer_list<par*> p) : ps(p)
+	{
+	}
+	all(std::initializer_list<par*> p, std::function<void(std::vector<ast*>&)> on_success) : ps(p), cb(on_success), has_cb(true)
+	{
+	}
+	void children(std::vector<par*>& out) const override
+	{
+		out.insert(std::end(out), std::begin(ps), std::end(ps));
+	}
+	par_res operator()(lex_buff& lb) const override
+	{
+		par_res res{ true, {} };
 		for (auto p : ps)
 		{
-			par_res sub_res = (*p)();
+			par_res sub_res = (*p)(lb);
 
 			if (!sub_res.success)
 			{
 				res.success = false;
 				for (auto n : res.result)
 				{
-					delete n;
+					delete_tree(n);
 				}
 				res.result.clear();
 				break;
@@ -449,18 +1250,20 @@ struct any : par
 
 	any(std::initializer_list<par*> p) : ps(p)
 	{
-		all_parsers.push_back(this);
 	}
 	any(std::initializer_list<par*> p, std::function<void(std::vector<ast*>&)> on_success) : ps(p), cb(on_success), has_cb(true)
 	{
-		all_parsers.push_back(this);
 	}
-	par_res operator()() override
+	void children(std::vector<par*>& out) const override
+	{
+		out.insert(std::end(out), std::begin(ps), std::end(ps));
+	}
+	par_res operator()(lex_buff& lb) const override
 	{
 		par_res res{ false, {} };
 		for (auto p : ps)
 		{
-			par_res sub_res = (*p)();
+			par_res sub_res = (*p)(lb);
 			if (sub_res.success)
 			{
 				res.success = true;
@@ -487,19 +1290,22 @@ struct many : par
 	std::function<void(std::vector<ast*>&)> cb;
 	many(par* s, par* pr) : sep(s), p(pr)
 	{
-		all_parsers.push_back(this);
 	}
 	many(par* s, par* pr, std::function<void(std::vector<ast*>&)> on_success) : sep(s), p(pr), has_cb(true), cb(on_success)
 	{
-		all_parsers.push_back(this);
 	}
-	par_res operator()() override
+	void children(std::vector<par*>& out) const override
+	{
+		out.push_back(sep);
+		out.push_back(p);
+	}
+	par_res operator()(lex_buff& lb) const override
 	{
 		par_res res{ false, {} };
 		bool odd = true;
 		for (;;)
 		{
-			par_res sub_res = (odd ? *p : *sep)();
+			par_res sub_res = (odd ? *p : *sep)(lb);
 			if (!sub_res.success)
 			{
 				break;
@@ -530,19 +1336,22 @@ struct sep_by : par
 	std::function<void(bool const, std::vector<ast*>&, std::vector<ast*>&)> cb;
 	sep_by(par* s, par* pr) : sep(s), p(pr)
 	{
-		all_parsers.push_back(this);
 	}
 	sep_by(par* s, par* pr, std::function<void(bool const, std::vector<ast*>&, std::vector<ast*>&)> on_success) : sep(s), p(pr), has_cb(true), cb(on_success)
 	{
-		all_parsers.push_back(this);
 	}
-	par_res operator()() override
+	void children(std::vector<par*>& out) const override
+	{
+		out.push_back(sep);
+		out.push_back(p);
+	}
+	par_res operator()(lex_buff& lb) const override
 	{
 		par_res res{ false, {} };
 		bool odd = true;
 		for (;;)
 		{
-			par_res sub_res = (odd ? *p : *sep)();
+			par_res sub_res = (odd ? *p : *sep)(lb);
 			if (!sub_res.success)
 			{
 				break;
@@ -559,7 +1368,7 @@ struct sep_by : par
 			res.success = false;
 			for (auto n : res.result)
 			{
-				delete n;
+				delete_tree(n);
 			}
 			res.result.clear();
 		}
@@ -573,18 +1382,22 @@ struct if_next : par
 	atom* second;
 	if_next(atom* first_, atom* next) : first(first_), second(next)
 	{
-		all_parsers.push_back(this);
 	}
-	par_res operator()()
+	void children(std::vector<par*>& out) const override
+	{
+		out.push_back(first);
+		out.push_back(second);
+	}
+	par_res operator()(lex_buff& lb) const override
 	{
-		auto res = (*first)();
+		auto res = (*first)(lb);
 		if(res.success)
 		{
-			auto sub_res = (*second)();
+			auto sub_res = (*second)(lb);
 			if (!sub_res.success)
 			{
-				push(sub_res.result);
-				push(res.result);
+				push(lb, sub_res.result);
+				push(lb, res.result);
 				res.success = false;
 			}
 			else if (!sub_res.result.empty())
@@ -594,7 +1407,7 @@ struct if_next : par
 		}
 		return res;
 	}
-	void push(std::vector<ast*>& as)
+	static void push(lex_buff& lb, std::vector<ast*>& as)
 	{
 		if (!as.empty())
 		{
@@ -603,18 +1416,22 @@ struct if_next : par
 			switch (n->type)
 			{
 			case ast::ast_type::symbol:
-				lex_b->push(token{ "symbol", reinterpret_cast<sym*>(n)->s });
+				{
+					token t{ "symbol", reinterpret_cast<sym*>(n)->s };
+					t.sym_id = reinterpret_cast<sym*>(n)->sym_id;
+					lb.push(t);
+				}
 				break;
 			case ast::ast_type::string:
-				lex_b->push(token{ "string", reinterpret_cast<str*>(n)->s });
+				lb.push(token{ "string", reinterpret_cast<str*>(n)->s });
 				break;
 			case ast::ast_type::number:
-				lex_b->push(token{ "number", reinterpret_cast<num*>(n)->n });
+				lb.push(token{ "number", reinterpret_cast<num*>(n)->n });
 				break;
 			default:
 				break;
 			}
-			delete n;
+			free_node(n);
 		}
 	}
 };
@@ -624,20 +1441,82 @@ struct opt : par
 	par* p;
 	opt(par* pr) : p(pr)
 	{
-		all_parsers.push_back(this);
 	}
-	par_res operator()() override
+	void children(std::vector<par*>& out) const override
+	{
+		out.push_back(p);
+	}
+	par_res operator()(lex_buff& lb) const override
+	{
+		return { true, (*p)(lb).result };
+	}
+};
+
+// Skips a '{ ... }' by brace balance only and yields a func stub holding its
+// tokens; rule builds the body when the func is first called.
+struct pre_parse : par
+{
+	par* rule;
+	pre_parse(par* body) : rule(body)
+	{
+	}
+	void children(std::vector<par*>& out) const override
+	{
+		out.push_back(rule);
+	}
+	par_res operator()(lex_buff& lb) const override
 	{
-		return { true, (*p)().result };
+		auto src = std::make_unique<lazy_source>();
+		src->rule = rule;
+		if (ast_pool::current != nullptr) src->pool = ast_pool::current->shared_from_this();
+		std::string closers;
+		do
+		{
+			auto t = lb();
+			bool const opens = t.ch == "{" || t.ch == "(";
+			bool const closes = t.ch == "}" || t.ch == ")";
+			if (t.ch.empty() || (src->tokens.empty() && t.ch != "{") || (closes && (closers.empty() || closers.back() != t.ch[0])))
+			{
+				if (!t.ch.empty()) src->tokens.push_back(std::move(t));
+				lb.push(src->tokens);
+				return { false, {} };
+			}
+			if (opens) closers += t.ch == "{" ? '}' : ')';
+			if (closes) closers.pop_back();
+			src->tokens.push_back(std::move(t));
+		} while (!closers.empty());
+		for (auto& t : src->tokens)
+		{
+			if (t.ch == "symbol") src->names.push_back(t.sym_id);
+		}
+		std::sort(std::begin(src->names), std::end(src->names));
+		src->names.erase(std::unique(std::begin(src->names), std::end(src->names)), std::end(src->names));
+		if (lb.text != nullptr)
+		{
+			src->text = lb.text;
+			src->begin = src->tokens.front().begin;
+			src->end = src->tokens.back().end;
+			src->tokens = {};
+		}
+		auto f = new func{};
+		f->lazy = std::move(src);
+		return { true, { f } };
 	}
 };
 
-struct parser
+// The Aynana grammar as a graph of parser combinators. It is built once and
+// never modified afterwards, so one instance can serve any number of
+// concurrent parses; all per-parse state lives in the lex_buff.
+struct grammar
 {
 	par* p;
-	parser(lex_buff& l)
+	par* stmt;
+	bool lazy{ false };
+	bool hash_cons{ false };
+	// lazy_lambdas: lambda bodies are only pre-parsed, see pre_parse.
+	// pooled: each parse interns its nodes in an ast_pool.
+	explicit grammar(bool lazy_lambdas = false, bool pooled = false) : lazy(lazy_lambdas), hash_cons(pooled)
 	{
-		par::lex_b = &l;
 		auto add_operator = [](bool const odd, std::vector<ast*>& as, std::vector<ast*>& n)
 		{
 			if (odd)
@@ -649,12 +1528,13 @@ struct parser
 				else
 				{
 					static_cast<operation*>(as.back())->r = n.back();
+					as.back() = ast_pool::intern(as.back());
 				}
 			}
 			else
 			{
 				as.back() = new operation{ reinterpret_cast<sym*>(n.back())->s, as.back() };
-				delete n.back();
+				free_node(n.back());
 				n.pop_back();
 			}
 		};
@@ -666,7 +1546,17 @@ struct parser
 		};
 		auto add_func = [](std::vector<ast*>& as)
 		{
-			auto f = new func{};
+			func* f = nullptr;
+			if (!as.empty() && as.back()->type == ast::ast_type::func)
+			{
+				// a pre-parsed body arrives as a stub
+				f = reinterpret_cast<func*>(as.back());
+				as.pop_back();
+			}
+			else
+			{
+				f = new func{};
+			}
 			if (!as.empty() && as.back()->type == ast::ast_type::body)
 			{
 				f->b = as.back();
@@ -675,7 +1565,8 @@ struct parser
 			for (auto a : as)
 			{
 				f->as.push_back(reinterpret_cast<sym*>(a)->s);
-				delete a;
+				f->sym_ids.push_back(reinterpret_cast<sym*>(a)->sym_id);
+				free_node(a);
 			}
 			as = { f };
 		};
@@ -687,7 +1578,7 @@ struct parser
 		};
 		auto complete_call = [](std::vector<ast*>& as)
 		{
-			if (as.back()->type == ast::ast_type::call)
+			if (as.size() > 1 && as.back()->type == ast::ast_type::call)
 			{
 				static_cast<call_*>(as.back())->src = as[0];
 				as[0] = as.back();
@@ -697,55 +1588,67 @@ struct parser
 		auto add_assignment = [](std::vector<ast*>& as)
 		{
 			auto s = reinterpret_cast<sym*>(as[0]);
-			as = { new assign(s->s, as[1]) };
-			delete s;
+			as = { new assign(s->s, s->sym_id, as[1]) };
+			free_node(s);
 		};
 		auto add_ite = [](std::vector<ast*>& as)
 		{
 			// if [0]()  [1]{}  else  [2]{}
-			as = { new ITE{ as[0], as[1], 2 < as.size() ? as[1] : nullptr } };
+			as = { new ITE{ as[0], 1 < as.size() ? as[1] : new body_(), 2 < as.size() ? as[1] : nullptr } };
 		};
 		auto add_for = [](std::vector<ast*>& as)
 		{
 			// for [0]i : [1]range [2]{}
 			sym* i = reinterpret_cast<sym*>(as[0]);
-			as = { new for_loop{ i->s, as[1], as[2] } };
-			delete i;
+			as = { new for_loop{ i->s, i->sym_id, as[1], 2 < as.size() ? as[2] : new body_() } };
+			free_node(i);
+		};
+		auto add_par = [](std::vector<ast*>& as)
+		{
+			// par [0]for
+			reinterpret_cast<for_loop*>(as[0])->parallel = true;
 		};
 		auto add_whl = [](std::vector<ast*>& as)
 		{
-			as = { new whl_loop{ as[0], as[1] } };
+			as = { new whl_loop{ as[0], 1 < as.size() ? as[1] : new body_() } };
+		};
+		auto add_op = [](std::vector<ast*>& as, token& tok)
+		{
+			as.push_back(new sym(tok.data, tok.sym_id));
 		};
 		auto add_sym = [](std::vector<ast*>& as, token& tok)
 		{
-			as.push_back(new sym(tok.data));
+			as.push_back(ast_pool::intern(new sym(tok.data, tok.sym_id)));
 		};
 		auto add_num = [](std::vector<ast*>& as, token& tok)
 		{
-			as.push_back(new num(tok.data));
+			as.push_back(ast_pool::intern(new num(tok.data)));
 		};
 		auto add_str = [](std::vector<ast*>& as, token& tok)
 		{
-			as.push_back(new str(tok.data));
+			as.push_back(ast_pool::intern(new str(tok.data)));
 		};
 		atom* symbol = _("symbol", add_sym);
 		any* term = new any{ symbol,_("number",add_num),_("string", add_str) };
 		all* call = new all({ _("(") }, add_call);
-		par* sub_expr4 = new sep_by(_("operation4", add_sym), term,     /**/ add_operator);
-		par* sub_expr3 = new sep_by(_("operation3", add_sym), sub_expr4,/**/ add_operator);
-		par* sub_expr2 = new sep_by(_("operation2", add_sym), sub_expr3,/**/ add_operator);
-		par* sub_expr1 = new sep_by(_("operation1", add_sym), sub_expr2,/**/ add_operator);
+		par* sub_expr4 = new sep_by(_("operation4", add_op), term,     /**/ add_operator);
+		par* sub_expr3 = new sep_by(_("operation3", add_op), sub_expr4,/**/ add_operator);
+		par* sub_expr2 = new sep_by(_("operation2", add_op), sub_expr3,/**/ add_operator);
+		par* sub_expr1 = new sep_by(_("operation1", add_op), sub_expr2,/**/ add_operator);
 		all* body = new all{ _("{") };
-		all* lambda = new all({ new opt{new all{_("\\"), new opt{new many{_(","),symbol}}}}, body }, add_func);
-		par* expr = new any{ new all({new sep_by{ _("operation0", add_sym), sub_expr1,/**/ add_operator }, new opt{call}}, complete_call), lambda };
+		all* lambda = new all({ new opt{new all{_("\\"), new opt{new many{_(","),symbol}}}}, lazy_lambdas ? static_cast<par*>(new pre_parse(body)) : body }, add_func);
+		any* expr = new any{ new all({new sep_by{ _("operation0", add_op), sub_expr1,/**/ add_operator }, new opt{call}}, complete_call), lambda };
 		term->ps.push_back(new all({ _("(") , expr,_(")") }));
 		call->ps.push_back(new any{ _(")"), new all{new many{_(","), expr},_(")")} });
 
 		par* assign = new all({ new if_next{symbol,_("=")}, expr }, add_assignment);
 		par* ite = new all({ _("if"), expr, body, new opt{new all{_("else"), body}} }, add_ite);
 		par* for_cycle = new all({ _("for"), new opt(_("(")), symbol,_(":"), expr, new opt(_(")")), body }, add_for);
+		par* par_cycle = new all({ _("par"), for_cycle }, add_par);
 		par* whl_cycle = new all({ _("while"), expr, body }, add_whl);
-		par* stmts = new many(_(";"), new any{ ite, for_cycle, whl_cycle, assign, expr },/**/ add_body);
+		expr->ps.push_back(par_cycle);
+		stmt = new any{ ite, for_cycle, whl_cycle, assign, expr };
+		par* stmts = new many(_(";"), stmt,/**/ add_body);
 		body->ps.push_back(new opt{ stmts });
 		body->ps.push_back(_("}"));
 
@@ -764,18 +1667,37 @@ struct parser
 		assign->id = "assign";
 		ite->id = "ite";
 		for_cycle->id = "for_cycle";
+		par_cycle->id = "par_cycle";
 		whl_cycle->id = "whl_cycle";
+		stmt->id = "stmt";
 		stmts->id = "stmts";
 	}
 
-	~parser()
+	grammar(grammar const&) = delete;
+	grammar& operator=(grammar const&) = delete;
+
+	~grammar()
 	{
-		par::remove_all();
+		std::vector<par*> pending{ p };
+		std::unordered_set<par*> seen;
+		while (!pending.empty())
+		{
+			auto n = pending.back();
+			pending.pop_back();
+			if (n != nullptr && seen.insert(n).second)
+			{
+				n->children(pending);
+			}
+		}
+		for (auto n : seen)
+		{
+			delete n;
+		}
 	}
 
-	par_res operator()()
+	par_res operator()(lex_buff& lb) const
 	{
-		return (*p)();
+		return (*p)(lb);
 	}
 	
 	static atom* _(std::string const& s)
@@ -788,353 +1710,5645 @@ struct parser
 	}
 };
 
-struct data_num : ast
+// Owns the AST of one parsed script; the nodes are freed with it.
+struct parse_tree
 {
-	float value;
-	data_num(float n) : ast(ast_type::data_num), value(n)
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+	bool success{ false };
+	ast* root{ nullptr };
+	std::shared_ptr<ast_pool> pool;
+	// Offset of the first token the parse did not take, npos when it took
+	// the whole input. A parse that stops early still succeeds with the
+	// statements before it.
+	size_t stopped_at{ npos };
+
+	parse_tree() = default;
+	parse_tree(parse_tree&& o) noexcept : success(o.success), root(o.root), pool(std::move(o.pool)), stopped_at(o.stopped_at)
 	{
+		o.root = nullptr;
 	}
-	std::string to_string() override
+	parse_tree(parse_tree const&) = delete;
+	parse_tree& operator=(parse_tree const&) = delete;
+
+	~parse_tree()
+	{
+		delete_tree(root);
+	}
+
+	static parse_tree parse(grammar const& g, std::istream& in)
 	{
-		return floorf(value) == value ? std::to_string(static_cast<int>(value)) : std::to_string(value);
+		std::shared_ptr<std::string const> text;
+		if (g.lazy)
+		{
+			text = std::make_shared<std::string const>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		}
+		chars_in_file chars = text != nullptr ? chars_in_file(*text, 0) : chars_in_file(in);
+		lex lexer(chars);
+		lex_buff lexer_b(lexer);
+		lexer_b.text = text;
+		parse_tree t;
+		if (g.hash_cons) t.pool = std::make_shared<ast_pool>();
+		ast_pool::use in_pool(t.pool.get());
+		auto res = g(lexer_b);
+		t.success = res.success;
+		if (auto rest = lexer_b(); !rest.ch.empty()) t.stopped_at = rest.begin;
+		if (res.success && !res.result.empty())
+		{
+			t.root = res.result.back();
+		}
+		return t;
 	}
 };
 
-struct data_str : ast
+struct syntax_error : std::runtime_error
 {
-	std::string value;
-	data_str(std::string s) : ast(ast_type::data_str), value(s)
+	using std::runtime_error::runtime_error;
+};
+
+inline ast* lazy_source::parse() const
+{
+	std::vector<token> lexed;
+	if (text != nullptr)
 	{
+		chars_in_file chars(*text, begin);
+		lex lexer(chars);
+		for (auto t = lexer(); !t.ch.empty() && t.begin < end; t = lexer())
+		{
+			lexed.push_back(std::move(t));
+		}
 	}
-	std::string to_string() override
+	auto const& ts = text != nullptr ? lexed : tokens;
+	lex_buff lb(ts, 0, ts.size());
+	lb.text = text;
+	ast_pool::use in_pool(pool.get());
+	auto res = (*rule)(lb);
+	bool const consumed = std::all_of(std::begin(lb.buffer), std::end(lb.buffer), [](token const& t) { return t.ch.empty(); });
+	if (res.success && consumed && res.result.size() <= 1)
 	{
-		return value;
+		return res.result.empty() ? nullptr : res.result.back();
 	}
-};
+	for (auto n : res.result)
+	{
+		delete_tree(n);
+	}
+	throw syntax_error("lambda body at offset " + std::to_string(ts.front().begin) + " does not parse");
+}
 
-struct data_obj : ast
+inline ast* func::body()
 {
-	std::map<std::string, ast*> value;
-	data_obj(std::map<std::string, ast*> const& o) : ast(ast_type::data_obj), value(o)
+	if (lazy != nullptr)
 	{
+		std::call_once(lazy->once, [this]
+		{
+			b = lazy->parse();
+			lazy->text = nullptr;
+			lazy->tokens = {};
+			lazy->names = {};
+			lazy->parsed.store(true, std::memory_order_release);
+		});
 	}
-	std::string to_string() override
+	return b;
+}
+
+// Parses every pre-parsed lambda body under root, for passes that need the
+// whole tree.
+inline void parse_lazy_bodies(ast* root)
+{
+	std::vector<ast*> pending{ root };
+	while (!pending.empty())
 	{
-		std::string res = "{";
-		bool first = true;
-		for (auto& [key, val] : value)
-		{
-			if (first) first = false;
-			else res += ", ";
-			res += key + ": " + (val == nullptr ? "null" : val->to_string());
-		}
-		return res + "}";
+		auto n = pending.back();
+		pending.pop_back();
+		if (n == nullptr) continue;
+		if (n->type == ast::ast_type::func) reinterpret_cast<func*>(n)->body();
+		visit_children(n, [&pending](ast* c) { pending.push_back(c); });
 	}
-};
+}
 
-struct data_vec : ast
+// A script kept open for editing. Its tokens are grouped by top-level
+// statement, each group ending with its ';'. An edit re-lexes from the first
+// statement it touches until the tokens line up with an old statement start
+// again, and only the statements in between are parsed anew. When a single
+// statement changes, only the damaged statements of the innermost body
+// around the change are reparsed and the rest of its tree is kept.
+struct source_file
 {
-	std::vector<ast*> value;
-	data_vec(std::vector<ast*> const& v) : ast(ast_type::data_vec), value(v)
+	source_file(grammar const& gr, std::string src) : g(gr), text(std::move(src))
 	{
+		edit(0, 0, {});
 	}
-	std::string to_string() override
+	source_file(source_file const&) = delete;
+	source_file& operator=(source_file const&) = delete;
+
+	~source_file()
 	{
-		std::string res = "[";
-		bool first = true;
-		for (auto val : value)
+		for (auto& st : stmts)
 		{
-			if (first) first = false;
-			else res += ", ";
-			res += val == nullptr ? "null" : val->to_string();
+			delete_tree(st.node);
 		}
-		return res + "]";
+		root.stmts.clear();
 	}
-};
 
-struct scope
-{
-	scope() = default;
-	
-	scope(scope const& s) : scp(s.scp)
+	// Replaces `removed` characters at `offset` with `inserted`.
+	void edit(size_t offset, size_t removed, std::string_view inserted)
 	{
+		offset = std::min(offset, text.size());
+		removed = std::min(removed, text.size() - offset);
+		text.replace(offset, removed, inserted);
+		auto const old_end = offset + removed;
+		auto const new_end = offset + inserted.size();
+		auto const delta = static_cast<ptrdiff_t>(inserted.size()) - static_cast<ptrdiff_t>(removed);
+
+		auto s0 = static_cast<size_t>(std::partition_point(std::begin(stmts), std::end(stmts),
+			[offset](statement const& st) { return st.end < offset; }) - std::begin(stmts));
+		if (s0 > 0 && stmts[s0 - 1].tokens.back().ch != ";") --s0;
+		size_t const start = s0 < stmts.size() ? std::min(stmts[s0].begin, offset) : offset;
+
+		chars_in_file chars(text, start);
+		lex lexer(chars);
+		std::vector<token> fresh;
+		size_t k = stmts.size();
+		int depth = 0;
+		for (;;)
+		{
+			auto t = lexer();
+			if (t.ch.empty() && chars.ch == EOF) break;
+			depth += nesting(t);
+			auto const at_end = depth == 0 && t.ch == ";" && t.end >= new_end;
+			fresh.push_back(std::move(t));
+			if (!at_end) continue;
+			auto q = fresh.back().end;
+			while (q < text.size() && class_of(static_cast<unsigned char>(text[q])) == char_class::space) ++q;
+			if (q == text.size()) break;
+			auto const was = static_cast<size_t>(static_cast<ptrdiff_t>(q) - delta);
+			auto it = std::lower_bound(std::begin(stmts) + s0, std::end(stmts), was,
+				[](statement const& st, size_t b) { return st.begin < b; });
+			if (it != std::end(stmts) && it->begin == was && was >= old_end)
+			{
+				k = static_cast<size_t>(it - std::begin(stmts));
+				break;
+			}
+		}
+
+		std::vector<statement> added;
+		for (auto [first, last] : split(fresh, 0, fresh.size()))
+		{
+			auto& st = added.emplace_back();
+			st.begin = fresh[first].begin;
+			st.end = fresh[last - 1].end;
+			st.tokens.assign(std::make_move_iterator(std::begin(fresh) + first), std::make_move_iterator(std::begin(fresh) + last));
+			for (auto& t : st.tokens)
+			{
+				t.begin -= st.begin;
+				t.end -= st.begin;
+			}
+		}
+
+		size_t kept = stmts.size();
+		if (k - s0 == 1 && added.size() == 1 && stmts[s0].node != nullptr && reparse_inner(stmts[s0], added[0].tokens))
+		{
+			added[0].node = stmts[s0].node;
+			kept = s0;
+		}
+		else
+		{
+			for (auto& st : added)
+			{
+				st.node = parse(st.tokens, 0, st.tokens.size());
+			}
+		}
+		for (size_t i = s0; i < k; ++i)
+		{
+			if (stmts[i].node == nullptr) --broken;
+			if (i != kept) delete_tree(stmts[i].node);
+		}
+		std::vector<ast*> nodes;
+		for (auto& st : added)
+		{
+			if (st.node == nullptr) ++broken;
+			nodes.push_back(st.node);
+		}
+		auto const tail = stmts.size() - k;
+		if (added.size() == k - s0)
+		{
+			std::move(std::begin(added), std::end(added), std::begin(stmts) + s0);
+			std::copy(std::begin(nodes), std::end(nodes), std::begin(root.stmts) + s0);
+		}
+		else
+		{
+			stmts.erase(std::begin(stmts) + s0, std::begin(stmts) + k);
+			stmts.insert(std::begin(stmts) + s0, std::make_move_iterator(std::begin(added)), std::make_move_iterator(std::end(added)));
+			root.stmts.erase(std::begin(root.stmts) + s0, std::begin(root.stmts) + k);
+			root.stmts.insert(std::begin(root.stmts) + s0, std::begin(nodes), std::end(nodes));
+		}
+		for (size_t i = stmts.size() - tail; i < stmts.size(); ++i)
+		{
+			stmts[i].begin += delta;
+			stmts[i].end += delta;
+		}
 	}
-	scope clone()
+
+	// Whether every statement parses; the tree is only meaningful then.
+	bool success() const
 	{
-		return scope(*this);
+		return !stmts.empty() && broken == 0;
 	}
-	void set(std::string const& key, ast* value)
+	ast* tree()
 	{
-		scp[key] = value;
+		return &root;
 	}
-	ast* get(std::string const& key)
+	std::string const& source() const
 	{
-		return scp[key];
+		return text;
 	}
 
-	bool has(std::string const& key)
+private:
+	struct statement
 	{
-		return scp.count(key);
-	}
+		size_t begin{ 0 };
+		size_t end{ 0 };
+		std::vector<token> tokens;
+		ast* node{ nullptr };
+	};
 
-private:
-	std::map<std::string, ast*> scp;
-};
+	grammar const& g;
+	std::string text;
+	std::vector<statement> stmts;
+	body_ root;
+	size_t broken{ 0 };
 
-struct block_context
-{
-	std::string module_name;
-	scope block_scope;
-	bool return_called{ false };
-	bool break_called{ false };
-	bool continue_called{ false };
-	ast* return_object{ nullptr };
-};
+	static int nesting(token const& t)
+	{
+		if (t.ch == "(" || t.ch == "{") return 1;
+		if (t.ch == ")" || t.ch == "}") return -1;
+		return 0;
+	}
 
-struct evaluator
-{
-	void run_func(func* f, const std::vector<ast*>& as)
+	// Statements of ts[first, last) as token ranges, each with its ';'.
+	static std::vector<std::pair<size_t, size_t>> split(std::vector<token> const& ts, size_t first, size_t last)
 	{
-		ctx.push_back({});
-		
-		for (size_t i = 0; i < as.size(); ++i)
+		std::vector<std::pair<size_t, size_t>> res;
+		int depth = 0;
+		for (size_t i = first, from = first; i < last; ++i)
 		{
-			set(f->as[i], as[i]);
-		}
-		eval(f->b);
-		if (ctx.back().return_object)
-		{
-			auto const ret = ctx.back().return_object;
-			ctx.pop_back();
-			if (!ctx.empty())
+			depth += nesting(ts[i]);
+			if ((depth == 0 && ts[i].ch == ";") || i + 1 == last)
 			{
-				auto& back = ctx.back();
-				back.return_object = ret;
-				back.return_called = true;
+				res.push_back({ from, i + 1 });
+				from = i + 1;
 			}
 		}
+		return res;
 	}
 
-	void eval(ast* node)
+	// One statement from ts[first, last), its ';' excluded; nullptr unless
+	// all of the tokens are consumed.
+	ast* parse(std::vector<token> const& ts, size_t first, size_t last) const
 	{
-		switch (node->type)
+		if (last > first && ts[last - 1].ch == ";") --last;
+		lex_buff lb(ts, first, last);
+		auto res = (*g.stmt)(lb);
+		bool const consumed = std::all_of(std::begin(lb.buffer), std::end(lb.buffer), [](token const& t) { return t.ch.empty(); });
+		if (res.success && consumed && res.result.size() == 1)
 		{
-		case ast::ast_type::assign:
-			if (!ctx.empty())
-			{
-				auto a = reinterpret_cast<assign*>(node);
-				eval(a->v);
-				set(a->id, ctx.back().return_object);
-				ctx.back().return_object = nullptr;
-			}
-			break;
-		case ast::ast_type::body:
-			{
-				ctx.push_back({});
+			return res.result.back();
+		}
+		for (auto n : res.result)
+		{
+			delete_tree(n);
+		}
+		return nullptr;
+	}
+
+	static bool same(token const& a, token const& b)
+	{
+		return a.ch == b.ch && a.data == b.data;
+	}
+
+	// Reparses only the statements of the innermost body of st that contain
+	// the difference between its tokens and fresh; false when the change
+	// is not inside a body or the tokens cannot be matched to st's tree.
+	bool reparse_inner(statement& st, std::vector<token> const& fresh)
+	{
+		auto const& old = st.tokens;
+		size_t a = 0;
+		while (a < old.size() && a < fresh.size() && same(old[a], fresh[a])) ++a;
+		if (a == old.size() && a == fresh.size()) return true;
+		size_t b = 0;
+		while (b < old.size() - a && b < fresh.size() - a && same(old[old.size() - 1 - b], fresh[fresh.size() - 1 - b])) ++b;
+
+		std::vector<size_t> open;
+		for (size_t i = 0; i < a; ++i)
+		{
+			if (old[i].ch == "{") open.push_back(i);
+			else if (old[i].ch == "}" && !open.empty()) open.pop_back();
+		}
+		size_t lo = 0, hi = 0;
+		int depth = 0;
+		for (size_t i = a; i < old.size() && !open.empty(); ++i)
+		{
+			if (old[i].ch == "{") ++depth;
+			else if (old[i].ch == "}" && depth-- == 0)
+			{
+				depth = 0;
+				if (i >= old.size() - b)
+				{
+					lo = open.back();
+					hi = i;
+					break;
+				}
+				open.pop_back();
+			}
+		}
+		if (hi == 0) return false;
+
+		std::vector<body_*> bodies;
+		std::unordered_set<ast*> seen;
+		std::vector<ast*> pending{ st.node };
+		while (!pending.empty())
+		{
+			auto n = pending.back();
+			pending.pop_back();
+			if (!seen.insert(n).second) continue;
+			if (n->type == ast::ast_type::body) bodies.push_back(reinterpret_cast<body_*>(n));
+			auto const at = pending.size();
+			visit_children(n, [&pending](ast* c) { pending.push_back(c); });
+			std::reverse(std::begin(pending) + at, std::end(pending));
+		}
+		auto const braces = std::count_if(std::begin(old), std::end(old), [](token const& t) { return t.ch == "{"; });
+		if (static_cast<size_t>(braces) != bodies.size()) return false;
+		auto target = bodies[std::count_if(std::begin(old), std::begin(old) + lo, [](token const& t) { return t.ch == "{"; })];
+
+		auto const was = split(old, lo + 1, hi);
+		auto const now = split(fresh, lo + 1, hi + fresh.size() - old.size());
+		if (was.size() != target->stmts.size() || now.empty()) return false;
+		size_t const x0 = a == 0 ? 0 : a - 1;
+		size_t const x1 = old.size() - b + 1;
+		size_t i0 = 0;
+		while (i0 < was.size() && was[i0].second <= x0) ++i0;
+		size_t i1 = i0;
+		while (i1 < was.size() && was[i1].first < x1) ++i1;
+		auto const tail = was.size() - i1;
+		if (now.size() < i0 + tail) return false;
+
+		std::vector<ast*> nodes;
+		for (size_t i = i0; i < now.size() - tail; ++i)
+		{
+			nodes.push_back(parse(fresh, now[i].first, now[i].second));
+			if (nodes.back() == nullptr)
+			{
+				for (auto n : nodes)
+				{
+					delete_tree(n);
+				}
+				return false;
+			}
+		}
+		for (size_t i = i0; i < i1; ++i)
+		{
+			delete_tree(target->stmts[i]);
+		}
+		target->stmts.erase(std::begin(target->stmts) + i0, std::begin(target->stmts) + i1);
+		target->stmts.insert(std::begin(target->stmts) + i0, std::begin(nodes), std::end(nodes));
+		return true;
+	}
+};
+
+struct heap;
+
+struct gc_object : ast
+{
+	heap* owner{ nullptr };
+	gc_object* next{ nullptr };
+	size_t gc_bytes{ 0 };
+	bool marked{ false };
+	bool old{ false };
+	bool remembered{ false };
+
+	gc_object(ast_type tp) : ast(tp, 0)
+	{
+	}
+	virtual void trace(std::vector<ast*>&)
+	{
+	}
+	virtual size_t bytes() const = 0;
+};
+
+struct data_num : gc_object
+{
+	double value;
+	data_num(double n) : gc_object(ast_type::data_num), value(n)
+	{
+	}
+	void write(out_buffer& out) override
+	{
+		out << value;
+	}
+	size_t bytes() const override
+	{
+		return sizeof(*this);
+	}
+};
+
+// Immutable string value. A data_str is either a flat leaf or a rope node
+// concatenating two other strings; a rope is flattened into `flat` the first
+// time its characters are needed, and the result is kept.
+struct data_str : gc_object
+{
+	data_str(std::string s) : gc_object(ast_type::data_str), length(s.size()), flat(std::move(s)), ready(true)
+	{
+	}
+	data_str(data_str* l, data_str* r) : gc_object(ast_type::data_str), length(l->length + r->length), left(l), right(r)
+	{
+	}
+	std::string const& str()
+	{
+		if (!ready.load(std::memory_order_acquire))
+		{
+			std::call_once(once, [this]
+			{
+				flatten();
+				ready.store(true, std::memory_order_release);
+			});
+		}
+		return flat;
+	}
+	size_t size() const
+	{
+		return length;
+	}
+	void write(out_buffer& out) override
+	{
+		if (ready.load(std::memory_order_acquire))
+		{
+			out << std::string_view(flat);
+			return;
+		}
+		std::vector<data_str*> pending{ right, left };
+		while (!pending.empty())
+		{
+			auto n = pending.back();
+			pending.pop_back();
+			if (n->ready.load(std::memory_order_acquire))
+			{
+				out << std::string_view(n->flat);
+			}
+			else
+			{
+				pending.push_back(n->right);
+				pending.push_back(n->left);
+			}
+		}
+	}
+	void trace(std::vector<ast*>& gray) override
+	{
+		if (left != nullptr)
+		{
+			gray.push_back(left);
+			gray.push_back(right);
+		}
+	}
+	size_t bytes() const override
+	{
+		return sizeof(*this) + (ready ? flat.capacity() : 0);
+	}
+
+private:
+	size_t length;
+	data_str* left{ nullptr };
+	data_str* right{ nullptr };
+	std::string flat;
+	std::once_flag once;
+	std::atomic<bool> ready{ false };
+
+	void flatten()
+	{
+		flat.reserve(length);
+		std::vector<data_str*> pending{ right, left };
+		while (!pending.empty())
+		{
+			auto n = pending.back();
+			pending.pop_back();
+			if (n->ready.load(std::memory_order_acquire))
+			{
+				flat += n->flat;
+			}
+			else
+			{
+				pending.push_back(n->right);
+				pending.push_back(n->left);
+			}
+		}
+	}
+};
+
+// Hidden class of a data_obj: the ordered list of its field names. Objects
+// built by adding the same keys in the same order share one shape, reached
+// through the transition tree from root(). Shapes live as long as the process
+// and are only created under a lock, so ids can be cached anywhere.
+struct shape
+{
+	uint32_t id;
+	std::vector<std::string> keys;
+
+	shape(uint32_t i, std::vector<std::string> const& k) : id(i), keys(k)
+	{
+	}
+
+	static shape* root()
+	{
+		static shape r{ 1, {} };
+		return &r;
+	}
+
+	size_t find(std::string const& key) const
+	{
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			if (keys[i] == key) return i;
+		}
+		return npos;
+	}
+
+	shape* with_key(std::string const& key)
+	{
+		static std::mutex lock;
+		static uint32_t last_id{ 1 };
+		std::lock_guard<std::mutex> guard(lock);
+		auto& next = transitions[key];
+		if (next == nullptr)
+		{
+			next = std::make_unique<shape>(++last_id, keys);
+			next->keys.push_back(key);
+		}
+		return next.get();
+	}
+
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+private:
+	std::map<std::string, std::unique_ptr<shape>> transitions;
+};
+
+struct data_obj : gc_object
+{
+	shape* shp;
+	std::vector<ast*> slots;
+	data_obj(shape* s, std::vector<ast*> const& v) : gc_object(ast_type::data_obj), shp(s), slots(v)
+	{
+	}
+	ast* get(std::string const& key) const
+	{
+		auto const i = shp->find(key);
+		return i == shape::npos ? nullptr : slots[i];
+	}
+	void write(out_buffer& out) override
+	{
+		out << '{';
+		for (size_t i = 0; i < slots.size(); ++i)
+		{
+			if (i != 0) out << ", ";
+			out << shp->keys[i] << ": ";
+			if (slots[i] == nullptr) out << "null";
+			else slots[i]->write(out);
+		}
+		out << '}';
+	}
+	void trace(std::vector<ast*>& gray) override
+	{
+		gray.insert(std::end(gray), std::begin(slots), std::end(slots));
+	}
+	size_t bytes() const override
+	{
+		return sizeof(*this) + slots.capacity() * sizeof(ast*);
+	}
+};
+
+// Inline cache of a `.` site holds (shape id << 32) | slot, 0 when empty.
+inline ast* load_property(std::atomic<uint64_t>& ic, data_obj* o, std::string const& key)
+{
+	auto const e = ic.load(std::memory_order_relaxed);
+	if (static_cast<uint32_t>(e >> 32) == o->shp->id)
+	{
+		return o->slots[static_cast<uint32_t>(e)];
+	}
+	auto const i = o->shp->find(key);
+	if (i == shape::npos) return nullptr;
+	ic.store(static_cast<uint64_t>(o->shp->id) << 32 | i, std::memory_order_relaxed);
+	return o->slots[i];
+}
+
+struct data_vec : gc_object
+{
+	std::vector<ast*> value;
+	data_vec(std::vector<ast*> const& v) : gc_object(ast_type::data_vec), value(v)
+	{
+	}
+	void write(out_buffer& out) override
+	{
+		out << '[';
+		bool first = true;
+		for (auto val : value)
+		{
+			if (first) first = false;
+			else out << ", ";
+			if (val == nullptr) out << "null";
+			else val->write(out);
+		}
+		out << ']';
+	}
+	void trace(std::vector<ast*>& gray) override
+	{
+		gray.insert(std::end(gray), std::begin(value), std::end(value));
+	}
+	size_t bytes() const override
+	{
+		return sizeof(*this) + value.capacity() * sizeof(ast*);
+	}
+};
+
+struct data_rng : gc_object
+{
+	double start;
+	double stop;
+	double step;
+	data_rng(double from, double to, double by) : gc_object(ast_type::data_rng), start(from), stop(to), step(by)
+	{
+	}
+	void write(out_buffer& out) override
+	{
+		out << "range(" << start << ", " << stop << ", " << step << ')';
+	}
+	size_t bytes() const override
+	{
+		return sizeof(*this);
+	}
+	size_t size() const
+	{
+		if (step == 0) return 0;
+		auto const n = ceil((stop - start) / step);
+		return n > 0 ? static_cast<size_t>(n) : 0;
+	}
+};
+
+template <typename T, size_t Align>
+struct aligned_allocator
+{
+	using value_type = T;
+
+	template <typename U>
+	struct rebind
+	{
+		using other = aligned_allocator<U, Align>;
+	};
+
+	aligned_allocator() = default;
+	template <typename U>
+	aligned_allocator(aligned_allocator<U, Align> const&)
+	{
+	}
+
+	T* allocate(size_t n)
+	{
+		return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{ Align }));
+	}
+	void deallocate(T* p, size_t)
+	{
+		::operator delete(p, std::align_val_t{ Align });
+	}
+
+	template <typename U>
+	bool operator==(aligned_allocator<U, Align> const&) const
+	{
+		return true;
+	}
+	template <typename U>
+	bool operator!=(aligned_allocator<U, Align> const&) const
+	{
+		return false;
+	}
+};
+
+struct data_arr : gc_object
+{
+	std::vector<double, aligned_allocator<double, 64>> value;
+	data_arr(size_t n, double fill = 0) : gc_object(ast_type::data_arr), value(n, fill)
+	{
+	}
+	void write(out_buffer& out) override
+	{
+		out << '[';
+		bool first = true;
+		for (auto val : value)
+		{
+			if (first) first = false;
+			else out << ", ";
+			out << val;
+		}
+		out << ']';
+	}
+	size_t bytes() const override
+	{
+		return sizeof(*this) + value.capacity() * sizeof(double);
+	}
+};
+
+struct channel;
+
+// Handle of a channel, or of the result of a task. The channel is shared by
+// every handle to it, whichever heap holds the handle.
+struct data_chan : gc_object
+{
+	std::shared_ptr<channel> ch;
+	data_chan(std::shared_ptr<channel> c) : gc_object(ast_type::data_chan), ch(std::move(c))
+	{
+	}
+	void write(out_buffer& out) override
+	{
+		out << "{ channel }";
+	}
+	size_t bytes() const override
+	{
+		return sizeof(*this);
+	}
+};
+
+inline bool is_data(ast* n)
+{
+	return n != nullptr && n->type >= ast::ast_type::data_num;
+}
+
+struct heap_exhausted : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+struct gc_stats
+{
+	size_t minor_collections{ 0 };
+	size_t major_collections{ 0 };
+	size_t allocated_objects{ 0 };
+	size_t freed_objects{ 0 };
+	size_t peak_bytes{ 0 };
+	double total_pause_us{ 0 };
+	double max_pause_us{ 0 };
+};
+
+// Generational mark-sweep heap for data_* values. Young objects are promoted
+// to the old generation when they survive a minor collection; a major
+// collection also sweeps the old generation. Collections only happen at
+// safepoints, so every live value must be reachable from scan_roots, frames
+// or the roots stack at that point.
+//
+// heap_limit is the memory budget of a run: values plus the scopes and call
+// frames tallied through enter_scope. Scopes are checked as they grow and
+// values at safepoints, after a collection; going over throws heap_exhausted.
+struct task_group;
+
+struct heap
+{
+	// Body of a task: calls its func on the task's heap, with the arguments
+	// already copied there.
+	using task_body = std::function<ast*(heap&, std::vector<ast*> const&)>;
+
+	size_t nursery_limit{ 1 << 20 };
+	size_t heap_limit{ 0 };
+
+	std::vector<ast*> roots;
+	std::vector<std::vector<ast*>*> frames;
+	std::function<void(std::vector<ast*>&)> scan_roots;
+	// Set by the backend running on this heap; spawn returns null without it.
+	std::function<task_body(func*)> launch;
+	task_group* tasks{ nullptr };
+	// Lowest stack address the calls on this heap may reach, for a task on
+	// a stack of its own; going below throws heap_exhausted.
+	uintptr_t stack_floor{ 0 };
+	gc_stats stats;
+	mem_report memory;
+
+	heap() = default;
+	heap(heap const&) = delete;
+	heap& operator=(heap const&) = delete;
+
+	~heap()
+	{
+		free_all(young);
+		free_all(old);
+	}
+
+	template <typename T, typename... Args>
+	T* make(Args&&... args)
+	{
+		auto o = new T(std::forward<Args>(args)...);
+		o->owner = this;
+		o->gc_bytes = o->bytes();
+		o->next = young;
+		young = o;
+		young_bytes += o->gc_bytes;
+		++stats.allocated_objects;
+		stats.peak_bytes = std::max(stats.peak_bytes, live_bytes());
+		usage(o->kind()).add(o->gc_bytes);
+		return o;
+	}
+
+	mem_usage& usage(mem_kind k)
+	{
+		return memory[static_cast<size_t>(k)];
+	}
+
+	void enter_scope(size_t bytes, size_t objects = 1)
+	{
+		auto& scopes = usage(mem_kind::scopes);
+		if (char here{}; reinterpret_cast<uintptr_t>(&here) < stack_floor)
+		{
+			throw heap_exhausted("stack of a task exhausted");
+		}
+		scopes.add(bytes, objects);
+		if (heap_limit != 0 && scopes.live_bytes > heap_limit)
+		{
+			throw heap_exhausted("memory budget of " + std::to_string(heap_limit) + " bytes exceeded by scopes");
+		}
+	}
+	void leave_scope(size_t bytes, size_t objects = 1)
+	{
+		usage(mem_kind::scopes).remove(bytes, objects);
+	}
+
+	void write_barrier(gc_object* owner, ast* value)
+	{
+		if (owner->owner == this && owner->old && !owner->remembered && is_data(value))
+		{
+			auto v = static_cast<gc_object*>(value);
+			if (v->owner == this && !v->old)
+			{
+				owner->remembered = true;
+				remembered.push_back(owner);
+			}
+		}
+	}
+
+	void safepoint()
+	{
+		bool const over_limit = heap_limit != 0 && budget_bytes() > heap_limit;
+		if (young_bytes < nursery_limit && !over_limit)
+		{
+			return;
+		}
+		collect(over_limit || old_bytes > old_limit);
+		if (heap_limit != 0 && budget_bytes() > heap_limit)
+		{
+			throw heap_exhausted("memory budget of " + std::to_string(heap_limit) + " bytes exceeded");
+		}
+	}
+
+	void collect(bool major)
+	{
+		auto const start = std::chrono::steady_clock::now();
+
+		std::vector<ast*> gray(std::begin(roots), std::end(roots));
+		if (scan_roots) scan_roots(gray);
+		for (auto f : frames)
+		{
+			gray.insert(std::end(gray), std::begin(*f), std::end(*f));
+		}
+		if (!major)
+		{
+			for (auto o : remembered)
+			{
+				o->trace(gray);
+			}
+		}
+		while (!gray.empty())
+		{
+			auto n = gray.back();
+			gray.pop_back();
+			if (!is_data(n)) continue;
+			auto o = static_cast<gc_object*>(n);
+			if (o->owner != this || o->marked || (o->old && !major)) continue;
+			o->marked = true;
+			o->trace(gray);
+		}
+
+		if (major)
+		{
+			old = sweep(old, old_bytes);
+			old_limit = std::max(old_limit, old_bytes * 2);
+			++stats.major_collections;
+		}
+		else
+		{
+			++stats.minor_collections;
+		}
+		size_t promoted_bytes = 0;
+		auto promoted = sweep(young, promoted_bytes);
+		while (promoted != nullptr)
+		{
+			auto next = promoted->next;
+			promoted->old = true;
+			promoted->next = old;
+			old = promoted;
+			promoted = next;
+		}
+		old_bytes += promoted_bytes;
+		young = nullptr;
+		young_bytes = 0;
+
+		for (auto o : remembered)
+		{
+			o->remembered = false;
+		}
+		remembered.clear();
+
+		std::chrono::duration<double, std::micro> const pause = std::chrono::steady_clock::now() - start;
+		stats.total_pause_us += pause.count();
+		stats.max_pause_us = std::max(stats.max_pause_us, pause.count());
+	}
+
+	size_t live_bytes() const
+	{
+		return young_bytes + old_bytes;
+	}
+
+	size_t budget_bytes() const
+	{
+		return live_bytes() + memory[static_cast<size_t>(mem_kind::scopes)].live_bytes;
+	}
+
+private:
+	gc_object* young{ nullptr };
+	gc_object* old{ nullptr };
+	size_t young_bytes{ 0 };
+	size_t old_bytes{ 0 };
+	size_t old_limit{ 8 << 20 };
+	std::vector<gc_object*> remembered;
+
+	gc_object* sweep(gc_object* list, size_t& bytes)
+	{
+		gc_object* survivors = nullptr;
+		bytes = 0;
+		while (list != nullptr)
+		{
+			auto next = list->next;
+			if (list->marked)
+			{
+				list->marked = false;
+				list->next = survivors;
+				survivors = list;
+				bytes += list->gc_bytes;
+			}
+			else
+			{
+				usage(list->kind()).remove(list->gc_bytes);
+				delete list;
+				++stats.freed_objects;
+			}
+			list = next;
+		}
+		return survivors;
+	}
+
+	static void free_all(gc_object* list)
+	{
+		while (list != nullptr)
+		{
+			auto next = list->next;
+			delete list;
+			list = next;
+		}
+	}
+};
+
+enum class arr_op
+{
+	add,
+	sub,
+	mul,
+	div,
+	lt,
+	gt,
+	eq,
+	none
+};
+
+inline arr_op to_arr_op(std::string const& op)
+{
+	if (op == "+") return arr_op::add;
+	if (op == "-") return arr_op::sub;
+	if (op == "*") return arr_op::mul;
+	if (op == "/") return arr_op::div;
+	if (op == "<") return arr_op::lt;
+	if (op == ">") return arr_op::gt;
+	if (op == "~") return arr_op::eq;
+	return arr_op::none;
+}
+
+inline double apply_num(arr_op op, double a, double b)
+{
+	switch (op)
+	{
+	case arr_op::add: return a + b;
+	case arr_op::sub: return a - b;
+	case arr_op::mul: return a * b;
+	case arr_op::div: return a / b;
+	case arr_op::lt: return a < b ? 1 : 0;
+	case arr_op::gt: return a > b ? 1 : 0;
+	case arr_op::eq: return a == b ? 1 : 0;
+	default: return a;
+	}
+}
+
+enum class arr_reduce
+{
+	sum,
+	min,
+	max,
+	dot
+};
+
+// Element-wise kernels over contiguous doubles. A null-stride operand
+// (a_step or b_step == 0) is a broadcast scalar. The AVX2 and SSE2 variants
+// are selected once at startup from cpuid; everything else uses the scalar
+// loop.
+struct simd_kernels
+{
+	using map_fn = void(*)(arr_op, double const*, size_t, double const*, size_t, double*, size_t);
+	using reduce_fn = double(*)(arr_reduce, double const*, double const*, size_t);
+
+	map_fn map;
+	reduce_fn reduce;
+	char const* name;
+
+	static simd_kernels const& get()
+	{
+		static simd_kernels const k = select();
+		return k;
+	}
+
+private:
+	static void map_scalar(arr_op op, double const* a, size_t a_step, double const* b, size_t b_step, double* out, size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			out[i] = apply_num(op, a[i * a_step], b[i * b_step]);
+		}
+	}
+
+	static double reduce_scalar(arr_reduce op, double const* a, double const* b, size_t n)
+	{
+		if (n == 0) return 0;
+		double res = op == arr_reduce::dot ? a[0] * b[0] : a[0];
+		for (size_t i = 1; i < n; ++i)
+		{
+			switch (op)
+			{
+			case arr_reduce::sum: res += a[i]; break;
+			case arr_reduce::min: res = std::min(res, a[i]); break;
+			case arr_reduce::max: res = std::max(res, a[i]); break;
+			case arr_reduce::dot: res += a[i] * b[i]; break;
+			}
+		}
+		return res;
+	}
+
+#if defined(AYNANA_X86_SIMD)
+	AYNANA_TARGET("sse2") static void map_sse2(arr_op op, double const* a, size_t a_step, double const* b, size_t b_step, double* out, size_t n)
+	{
+		size_t i = 0;
+		__m128d const ones = _mm_set1_pd(1.0);
+		for (; i + 2 <= n; i += 2)
+		{
+			__m128d const x = a_step ? _mm_loadu_pd(a + i) : _mm_set1_pd(*a);
+			__m128d const y = b_step ? _mm_loadu_pd(b + i) : _mm_set1_pd(*b);
+			__m128d r;
+			switch (op)
+			{
+			case arr_op::add: r = _mm_add_pd(x, y); break;
+			case arr_op::sub: r = _mm_sub_pd(x, y); break;
+			case arr_op::mul: r = _mm_mul_pd(x, y); break;
+			case arr_op::div: r = _mm_div_pd(x, y); break;
+			case arr_op::lt: r = _mm_and_pd(_mm_cmplt_pd(x, y), ones); break;
+			case arr_op::gt: r = _mm_and_pd(_mm_cmpgt_pd(x, y), ones); break;
+			case arr_op::eq: r = _mm_and_pd(_mm_cmpeq_pd(x, y), ones); break;
+			default: r = x; break;
+			}
+			_mm_storeu_pd(out + i, r);
+		}
+		map_scalar(op, a + i * a_step, a_step, b + i * b_step, b_step, out + i, n - i);
+	}
+
+	AYNANA_TARGET("avx2") static void map_avx2(arr_op op, double const* a, size_t a_step, double const* b, size_t b_step, double* out, size_t n)
+	{
+		size_t i = 0;
+		__m256d const ones = _mm256_set1_pd(1.0);
+		for (; i + 4 <= n; i += 4)
+		{
+			__m256d const x = a_step ? _mm256_loadu_pd(a + i) : _mm256_set1_pd(*a);
+			__m256d const y = b_step ? _mm256_loadu_pd(b + i) : _mm256_set1_pd(*b);
+			__m256d r;
+			switch (op)
+			{
+			case arr_op::add: r = _mm256_add_pd(x, y); break;
+			case arr_op::sub: r = _mm256_sub_pd(x, y); break;
+			case arr_op::mul: r = _mm256_mul_pd(x, y); break;
+			case arr_op::div: r = _mm256_div_pd(x, y); break;
+			case arr_op::lt: r = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_LT_OQ), ones); break;
+			case arr_op::gt: r = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_GT_OQ), ones); break;
+			case arr_op::eq: r = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_EQ_OQ), ones); break;
+			default: r = x; break;
+			}
+			_mm256_storeu_pd(out + i, r);
+		}
+		map_scalar(op, a + i * a_step, a_step, b + i * b_step, b_step, out + i, n - i);
+	}
+
+	AYNANA_TARGET("avx2") static double reduce_avx2(arr_reduce op, double const* a, double const* b, size_t n)
+	{
+		if (n < 8) return reduce_scalar(op, a, b, n);
+		__m256d acc = op == arr_reduce::dot ? _mm256_mul_pd(_mm256_loadu_pd(a), _mm256_loadu_pd(b)) : _mm256_loadu_pd(a);
+		size_t i = 4;
+		for (; i + 4 <= n; i += 4)
+		{
+			__m256d const x = _mm256_loadu_pd(a + i);
+			switch (op)
+			{
+			case arr_reduce::sum: acc = _mm256_add_pd(acc, x); break;
+			case arr_reduce::min: acc = _mm256_min_pd(acc, x); break;
+			case arr_reduce::max: acc = _mm256_max_pd(acc, x); break;
+			case arr_reduce::dot: acc = _mm256_add_pd(acc, _mm256_mul_pd(x, _mm256_loadu_pd(b + i))); break;
+			}
+		}
+		alignas(32) double lanes[4];
+		_mm256_store_pd(lanes, acc);
+		auto const fold = op == arr_reduce::dot ? arr_reduce::sum : op;
+		double res = reduce_scalar(fold, lanes, nullptr, 4);
+		for (; i < n; ++i)
+		{
+			switch (op)
+			{
+			case arr_reduce::sum: res += a[i]; break;
+			case arr_reduce::min: res = std::min(res, a[i]); break;
+			case arr_reduce::max: res = std::max(res, a[i]); break;
+			case arr_reduce::dot: res += a[i] * b[i]; break;
+			}
+		}
+		return res;
+	}
+
+	static bool has_avx2()
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) return false;
+		__cpuid(info, 1);
+		bool const osxsave = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+		if (!osxsave || (_xgetbv(0) & 6) != 6) return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+
+	static simd_kernels select()
+	{
+		if (has_avx2()) return { map_avx2, reduce_avx2, "avx2" };
+		return { map_sse2, reduce_scalar, "sse2" };
+	}
+#else
+	static simd_kernels select()
+	{
+		return { map_scalar, reduce_scalar, "scalar" };
+	}
+#endif
+};
+
+inline ast* apply_array_operation(heap& mem, arr_op op, ast* l, ast* r)
+{
+	auto const l_arr = l->type == ast::ast_type::data_arr;
+	auto const r_arr = r->type == ast::ast_type::data_arr;
+	if ((!l_arr && l->type != ast::ast_type::data_num) || (!r_arr && r->type != ast::ast_type::data_num) || op == arr_op::none)
+	{
+		return nullptr;
+	}
+	double const* a = l_arr ? reinterpret_cast<data_arr*>(l)->value.data() : &reinterpret_cast<data_num*>(l)->value;
+	double const* b = r_arr ? reinterpret_cast<data_arr*>(r)->value.data() : &reinterpret_cast<data_num*>(r)->value;
+	size_t const n = l_arr ? reinterpret_cast<data_arr*>(l)->value.size() : reinterpret_cast<data_arr*>(r)->value.size();
+	if (l_arr && r_arr && reinterpret_cast<data_arr*>(r)->value.size() != n)
+	{
+		return nullptr;
+	}
+	auto res = mem.make<data_arr>(n);
+	simd_kernels::get().map(op, a, l_arr ? 1 : 0, b, r_arr ? 1 : 0, res->value.data(), n);
+	return res;
+}
+
+inline str::~str()
+{
+	delete interned.load(std::memory_order_relaxed);
+}
+
+inline data_str* str::value()
+{
+	auto res = interned.load(std::memory_order_acquire);
+	if (res == nullptr)
+	{
+		auto made = new data_str(s);
+		if (interned.compare_exchange_strong(res, made, std::memory_order_acq_rel)) return made;
+		delete made;
+	}
+	return res;
+}
+
+inline data_str* concat(heap& mem, data_str* l, data_str* r)
+{
+	if (l->size() == 0) return r;
+	if (r->size() == 0) return l;
+	if (l->size() + r->size() <= 64)
+	{
+		return mem.make<data_str>(l->str() + r->str());
+	}
+	return mem.make<data_str>(l, r);
+}
+
+inline ast* apply_operation(heap& mem, std::string const& op, ast* l, ast* r)
+{
+	if (l == nullptr || r == nullptr)
+	{
+		return nullptr;
+	}
+	if (l->type == ast::ast_type::data_num && r->type == ast::ast_type::data_num)
+	{
+		auto const o = to_arr_op(op);
+		if (o == arr_op::none) return l;
+		return mem.make<data_num>(apply_num(o, reinterpret_cast<data_num*>(l)->value, reinterpret_cast<data_num*>(r)->value));
+	}
+	if (l->type == ast::ast_type::data_arr || r->type == ast::ast_type::data_arr)
+	{
+		return apply_array_operation(mem, to_arr_op(op), l, r);
+	}
+	if (l->type == ast::ast_type::data_str && r->type == ast::ast_type::data_str)
+	{
+		return op == "+" ? concat(mem, reinterpret_cast<data_str*>(l), reinterpret_cast<data_str*>(r)) : l;
+	}
+	if (l->type == ast::ast_type::data_str && r->type == ast::ast_type::data_num)
+	{
+		return op == "+" ? concat(mem, reinterpret_cast<data_str*>(l), mem.make<data_str>(r->to_string())) : l;
+	}
+	if (l->type == ast::ast_type::data_num && r->type == ast::ast_type::data_str)
+	{
+		return op == "+" ? concat(mem, mem.make<data_str>(l->to_string()), reinterpret_cast<data_str*>(r)) : r;
+	}
+	return nullptr;
+}
+
+struct jit_kernel;
+
+// A func body compiled for numbers: straight-line code over registers of
+// doubles, with the same arithmetic as data_num operations. Registers start
+// with the parameters; `init` holds the constants at their registers.
+struct num_kernel
+{
+	struct instr
+	{
+		arr_op op;
+		uint8_t dst;
+		uint8_t a;
+		uint8_t b;
+	};
+	static constexpr size_t max_registers = 64;
+
+	size_t params{ 0 };
+	std::vector<double> init;
+	std::vector<instr> code;
+	uint8_t result{ 0 };
+	// runs so far, and the machine code built once they reach jit_kernel::hot_runs
+	std::atomic<uint32_t> runs{ 0 };
+	std::atomic<jit_kernel*> native{ nullptr };
+
+	num_kernel() = default;
+	num_kernel(num_kernel const&) = delete;
+	num_kernel& operator=(num_kernel const&) = delete;
+	~num_kernel();
+
+	// run, or the machine code for it when there is some.
+	double call(double const* args);
+
+	double run(double const* args) const
+	{
+		double regs[max_registers];
+		std::copy(std::begin(init), std::end(init), regs);
+		std::copy(args, args + params, regs);
+		for (auto const& i : code)
+		{
+			regs[i.dst] = apply_num(i.op, regs[i.a], regs[i.b]);
+		}
+		return regs[result];
+	}
+
+	// Null unless the body is assignments and arithmetic over numbers,
+	// parameters and earlier locals, ending in an expression.
+	static std::unique_ptr<num_kernel> compile(func* f)
+	{
+		if (f->body() == nullptr || f->b->type != ast::ast_type::body || f->as.size() > type_feedback::max_args) return nullptr;
+		auto& stmts = reinterpret_cast<body_*>(f->b)->stmts;
+		if (stmts.empty() || stmts.back()->type == ast::ast_type::assign) return nullptr;
+
+		auto k = std::make_unique<num_kernel>();
+		k->params = f->as.size();
+		k->init.resize(k->params);
+		std::unordered_map<uint32_t, uint8_t> names;
+		for (size_t i = 0; i < f->sym_ids.size(); ++i)
+		{
+			names[f->sym_ids[i]] = static_cast<uint8_t>(i);
+		}
+		bool ok = true;
+		auto fresh = [&k, &ok]
+		{
+			if (k->init.size() == max_registers) ok = false;
+			k->init.push_back(0);
+			return static_cast<uint8_t>(k->init.size() - 1);
+		};
+		std::function<uint8_t(ast*)> emit = [&](ast* n) -> uint8_t
+		{
+			switch (n->type)
+			{
+			case ast::ast_type::number:
+				{
+					auto const r = fresh();
+					k->init[r] = atof(reinterpret_cast<num*>(n)->n.c_str());
+					return r;
+				}
+			case ast::ast_type::symbol:
+				if (auto it = names.find(reinterpret_cast<sym*>(n)->sym_id); it != std::end(names)) return it->second;
+				break;
+			case ast::ast_type::operation:
+				{
+					auto o = reinterpret_cast<operation*>(n);
+					auto const op = to_arr_op(o->op);
+					if (op == arr_op::none || o->r == nullptr) break;
+					auto const a = emit(o->l);
+					auto const b = emit(o->r);
+					auto const r = fresh();
+					k->code.push_back({ op, r, a, b });
+					return r;
+				}
+			default:
+				break;
+			}
+			ok = false;
+			return 0;
+		};
+		for (auto stmt : stmts)
+		{
+			if (stmt->type == ast::ast_type::assign)
+			{
+				auto a = reinterpret_cast<assign*>(stmt);
+				names[a->sym_id] = emit(a->v);
+			}
+			else
+			{
+				k->result = emit(stmt);
+			}
+			if (!ok) return nullptr;
+		}
+		return k;
+	}
+};
+
+inline func::~func()
+{
+	delete kernel.load();
+}
+
+// Off with --no-kernels: funcs are profiled but never given a kernel.
+inline std::atomic<bool> numeric_kernels{ true };
+
+// Off with --no-jit: kernels stay interpreted. Can be flipped while
+// scripts run; calls check it each time.
+inline std::atomic<bool> native_code{ true };
+
+// With --jit-verify every call of machine code also runs the interpreted
+// kernel, and the interpreted result is the one used.
+struct jit_stats
+{
+	std::atomic<bool> verify{ false };
+	std::atomic<size_t> compiled{ 0 };
+	std::atomic<size_t> checked{ 0 };
+	std::atomic<size_t> mismatched{ 0 };
+};
+
+inline jit_stats& native_stats()
+{
+	static jit_stats stats;
+	return stats;
+}
+
+// x86-64 machine code for a num_kernel, in a mapping of its own that is
+// made executable, and no longer writable, once the code is in. The first
+// fourteen registers live in xmm0-xmm13 for the whole call and the rest in
+// a stack frame; xmm14 holds 1.0 for comparisons and xmm15 is scratch.
+// Constants come from a pool after the code. Kernels read nothing but their
+// arguments, so the type checks before a call are the only guard, and a
+// call with other arguments runs the interpreter instead.
+struct jit_kernel
+{
+	using entry = double(*)(double const* args);
+	static constexpr uint32_t hot_runs = 1000;
+
+	entry fn{ nullptr };
+
+	jit_kernel(jit_kernel const&) = delete;
+	jit_kernel& operator=(jit_kernel const&) = delete;
+	~jit_kernel()
+	{
+#if defined(AYNANA_JIT)
+		if (code != nullptr) munmap(code, size);
+#endif
+	}
+
+	// Null where there is no JIT or the code cannot be mapped.
+	static std::unique_ptr<jit_kernel> compile(num_kernel const& k)
+	{
+#if defined(AYNANA_JIT)
+		auto bytes = assemble(k);
+		auto const page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		auto const size = (bytes.size() + page - 1) / page * page;
+		auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) return nullptr;
+		std::memcpy(p, bytes.data(), bytes.size());
+		if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0)
+		{
+			munmap(p, size);
+			return nullptr;
+		}
+		std::unique_ptr<jit_kernel> j(new jit_kernel(p, size));
+		j->fn = reinterpret_cast<entry>(p);
+		native_stats().compiled++;
+		return j;
+#else
+		(void)k;
+		return nullptr;
+#endif
+	}
+
+private:
+	void* code{ nullptr };
+	size_t size{ 0 };
+
+	jit_kernel(void* c, size_t n) : code(c), size(n)
+	{
+	}
+
+#if defined(AYNANA_JIT)
+	static constexpr uint8_t pinned = 14;
+	static constexpr uint8_t one = 14;
+	static constexpr uint8_t scratch = 15;
+
+	// Where a register lives: an xmm register, or a slot of the frame.
+	struct place
+	{
+		bool frame;
+		uint8_t xmm;
+		int32_t disp;
+	};
+
+	struct assembler
+	{
+		std::vector<uint8_t> out;
+		// code offsets of rip-relative displacements, with the constant each wants
+		std::vector<std::pair<size_t, double>> pool_refs;
+
+		void byte(uint8_t b)
+		{
+			out.push_back(b);
+		}
+		void dword(int32_t v)
+		{
+			for (int i = 0; i < 4; ++i)
+			{
+				byte(static_cast<uint8_t>(static_cast<uint32_t>(v) >> (8 * i)));
+			}
+		}
+		// prefix [REX] 0F op with reg in ModRM.reg and an xmm or frame slot
+		// in ModRM.rm.
+		void op(uint8_t prefix, uint8_t opcode, uint8_t reg, place rm)
+		{
+			byte(prefix);
+			uint8_t const rex = 0x40 | (reg >= 8 ? 4 : 0) | (!rm.frame && rm.xmm >= 8 ? 1 : 0);
+			if (rex != 0x40) byte(rex);
+			byte(0x0F);
+			byte(opcode);
+			if (!rm.frame)
+			{
+				byte(static_cast<uint8_t>(0xC0 | (reg & 7) << 3 | (rm.xmm & 7)));
+				return;
+			}
+			byte(static_cast<uint8_t>(0x84 | (reg & 7) << 3));
+			byte(0x24);
+			dword(rm.disp);
+		}
+		// movsd reg, [rdi + disp]
+		void load_arg(uint8_t reg, int32_t disp)
+		{
+			byte(0xF2);
+			if (reg >= 8) byte(0x44);
+			byte(0x0F);
+			byte(0x10);
+			byte(static_cast<uint8_t>(0x87 | (reg & 7) << 3));
+			dword(disp);
+		}
+		// movsd reg, [rip + constant]
+		void load_const(uint8_t reg, double v)
+		{
+			byte(0xF2);
+			if (reg >= 8) byte(0x44);
+			byte(0x0F);
+			byte(0x10);
+			byte(static_cast<uint8_t>(0x05 | (reg & 7) << 3));
+			pool_refs.push_back({ out.size(), v });
+			dword(0);
+		}
+		void move(place dst, place src)
+		{
+			if (!dst.frame && !src.frame)
+			{
+				if (dst.xmm != src.xmm) op(0x66, 0x28, dst.xmm, src);
+			}
+			else if (!dst.frame)
+			{
+				op(0xF2, 0x10, dst.xmm, src);
+			}
+			else
+			{
+				op(0xF2, 0x11, src.xmm, dst);
+			}
+		}
+		void stack(uint8_t opcode, int32_t bytes)
+		{
+			byte(0x48);
+			byte(0x81);
+			byte(opcode);
+			dword(bytes);
+		}
+		// Appends the constants, 8-byte aligned, and points the loads at them.
+		void finish()
+		{
+			while (out.size() % 8 != 0)
+			{
+				byte(0xCC);
+			}
+			std::vector<double> pool;
+			for (auto& [at, v] : pool_refs)
+			{
+				auto it = std::find_if(std::begin(pool), std::end(pool), [v](double c) { return std::memcmp(&c, &v, sizeof c) == 0; });
+				auto const index = static_cast<size_t>(it - std::begin(pool));
+				if (it == std::end(pool)) pool.push_back(v);
+				auto const disp = static_cast<int32_t>(out.size() + index * sizeof(double) - (at + 4));
+				std::memcpy(out.data() + at, &disp, sizeof disp);
+			}
+			auto const base = out.size();
+			out.resize(base + pool.size() * sizeof(double));
+			std::memcpy(out.data() + base, pool.data(), pool.size() * sizeof(double));
+		}
+	};
+
+	static std::vector<uint8_t> assemble(num_kernel const& k)
+	{
+		auto const regs = k.init.size();
+		auto const frame = static_cast<int32_t>(regs > pinned ? (regs - pinned) * sizeof(double) : 0);
+		auto at = [](size_t r) -> place
+		{
+			if (r < pinned) return { false, static_cast<uint8_t>(r), 0 };
+			return { true, 0, static_cast<int32_t>((r - pinned) * sizeof(double)) };
+		};
+		place const tmp{ false, scratch, 0 };
+
+		std::vector<bool> computed(regs, false);
+		for (auto const& i : k.code)
+		{
+			computed[i.dst] = true;
+		}
+		assembler a;
+		if (frame != 0) a.stack(0xEC, frame);
+		for (size_t r = 0; r < regs; ++r)
+		{
+			if (computed[r]) continue;
+			auto const dst = at(r);
+			auto const reg = dst.frame ? scratch : dst.xmm;
+			if (r < k.params) a.load_arg(reg, static_cast<int32_t>(r * sizeof(double)));
+			else a.load_const(reg, k.init[r]);
+			if (dst.frame) a.move(dst, tmp);
+		}
+		a.load_const(one, 1.0);
+		for (auto const& i : k.code)
+		{
+			auto const dst = at(i.dst);
+			auto const t = dst.frame ? tmp : dst;
+			switch (i.op)
+			{
+			case arr_op::add:
+			case arr_op::sub:
+			case arr_op::mul:
+			case arr_op::div:
+				{
+					static constexpr uint8_t opcodes[] = { 0x58, 0x5C, 0x59, 0x5E };
+					a.move(t, at(i.a));
+					a.op(0xF2, opcodes[static_cast<int>(i.op)], t.xmm, at(i.b));
+				}
+				break;
+			case arr_op::lt:
+			case arr_op::gt:
+			case arr_op::eq:
+				{
+					// cmpsd leaves an all-ones mask for true; masking 1.0 gives 1 or 0
+					bool const swap = i.op == arr_op::gt;
+					a.move(t, at(swap ? i.b : i.a));
+					a.op(0xF2, 0xC2, t.xmm, at(swap ? i.a : i.b));
+					a.byte(i.op == arr_op::eq ? 0 : 1);
+					a.op(0x66, 0x54, t.xmm, place{ false, one, 0 });
+				}
+				break;
+			default:
+				a.move(t, at(i.a));
+				break;
+			}
+			if (dst.frame) a.move(dst, tmp);
+		}
+		a.move(place{ false, 0, 0 }, at(k.result));
+		if (frame != 0) a.stack(0xC4, frame);
+		a.byte(0xC3);
+		a.finish();
+		return a.out;
+	}
+#endif
+};
+
+inline num_kernel::~num_kernel()
+{
+	delete native.load();
+}
+
+inline double num_kernel::call(double const* args)
+{
+	if (!native_code.load(std::memory_order_relaxed)) return run(args);
+	auto j = native.load(std::memory_order_acquire);
+	if (j == nullptr)
+	{
+		if (runs.fetch_add(1, std::memory_order_relaxed) + 1 == jit_kernel::hot_runs)
+		{
+			native.store(jit_kernel::compile(*this).release(), std::memory_order_release);
+		}
+		return run(args);
+	}
+	auto& stats = native_stats();
+	if (!stats.verify.load(std::memory_order_relaxed)) return j->fn(args);
+	auto const got = j->fn(args);
+	auto const want = run(args);
+	stats.checked++;
+	if (std::memcmp(&got, &want, sizeof got) != 0 && !(std::isnan(got) && std::isnan(want))) stats.mismatched++;
+	return want;
+}
+
+// Runs f's kernel when it has one and every argument is a number; false
+// sends the call down the generic path.
+inline bool run_kernel(func* f, heap& mem, ast* const* args, size_t n, ast*& res)
+{
+	auto k = f->kernel.load(std::memory_order_acquire);
+	if (k == nullptr || n != k->params) return false;
+	double xs[type_feedback::max_args];
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (args[i] == nullptr || args[i]->type != ast::ast_type::data_num) return false;
+		xs[i] = reinterpret_cast<data_num*>(args[i])->value;
+	}
+	res = mem.make<data_num>(k->call(xs));
+	return true;
+}
+
+// Type feedback from a generic call, before its body runs.
+inline void note_arguments(func* f, ast* const* args, size_t n)
+{
+	auto& fb = f->profile;
+	if (fb.status.load(std::memory_order_relaxed) != type_feedback::state::profiling) return;
+	if (n != f->as.size() || n > type_feedback::max_args)
+	{
+		fb.status.store(type_feedback::state::generic, std::memory_order_relaxed);
+		return;
+	}
+	for (size_t i = 0; i < n; ++i)
+	{
+		type_feedback::note(fb.args[i], args[i]);
+	}
+}
+
+// Type feedback from a generic call, after its body ran. The call that
+// makes f hot compiles its kernel when every argument and result so far
+// was a number.
+inline void note_result(func* f, ast* res)
+{
+	auto& fb = f->profile;
+	if (fb.status.load(std::memory_order_relaxed) != type_feedback::state::profiling) return;
+	type_feedback::note(fb.result, res);
+	if (fb.calls.fetch_add(1, std::memory_order_relaxed) + 1 != type_feedback::hot_calls) return;
+
+	auto const number = 2u << static_cast<uint32_t>(ast::ast_type::data_num);
+	bool monomorphic = fb.result.load() == number;
+	for (size_t i = 0; i < f->as.size(); ++i)
+	{
+		monomorphic = monomorphic && fb.args[i].load() == number;
+	}
+	auto k = monomorphic && numeric_kernels.load() ? num_kernel::compile(f) : nullptr;
+	if (k != nullptr) f->kernel.store(k.release(), std::memory_order_release);
+	fb.status.store(f->kernel.load() != nullptr ? type_feedback::state::compiled : type_feedback::state::generic, std::memory_order_relaxed);
+}
+
+struct native : ast
+{
+	using fn_type = ast*(*)(heap&, std::vector<ast*> const&);
+	std::string name;
+	fn_type fn;
+	native(std::string const& n, fn_type f) : ast(ast_type::native, sizeof(native)), name(n), fn(f)
+	{
+	}
+	void write(out_buffer& out) override
+	{
+		out << "{ native " << name << " }";
+	}
+};
+
+inline ast* builtin_range(heap& mem, std::vector<ast*> const& as)
+{
+	double args[3]{ 0, 0, 1 };
+	if (as.empty() || as.size() > 3) return nullptr;
+	for (size_t i = 0; i < as.size(); ++i)
+	{
+		if (as[i] == nullptr || as[i]->type != ast::ast_type::data_num) return nullptr;
+		args[as.size() == 1 ? 1 : i] = reinterpret_cast<data_num*>(as[i])->value;
+	}
+	return mem.make<data_rng>(args[0], args[1], args[2]);
+}
+
+inline ast* builtin_array(heap& mem, std::vector<ast*> const& as)
+{
+	if (as.empty() || as.size() > 2 || as[0] == nullptr) return nullptr;
+	double fill = 0;
+	if (as.size() == 2)
+	{
+		if (as[1] == nullptr || as[1]->type != ast::ast_type::data_num) return nullptr;
+		fill = reinterpret_cast<data_num*>(as[1])->value;
+	}
+	switch (as[0]->type)
+	{
+	case ast::ast_type::data_num:
+		{
+			auto const n = reinterpret_cast<data_num*>(as[0])->value;
+			return mem.make<data_arr>(n > 0 ? static_cast<size_t>(n) : 0, fill);
+		}
+	case ast::ast_type::data_rng:
+		{
+			auto r = reinterpret_cast<data_rng*>(as[0]);
+			auto res = mem.make<data_arr>(r->size());
+			for (size_t i = 0; i < res->value.size(); ++i)
+			{
+				res->value[i] = r->start + static_cast<double>(i) * r->step;
+			}
+			return res;
+		}
+	case ast::ast_type::data_vec:
+		{
+			auto& v = reinterpret_cast<data_vec*>(as[0])->value;
+			auto res = mem.make<data_arr>(v.size());
+			for (size_t i = 0; i < v.size(); ++i)
+			{
+				if (v[i] == nullptr || v[i]->type != ast::ast_type::data_num) return nullptr;
+				res->value[i] = reinterpret_cast<data_num*>(v[i])->value;
+			}
+			return res;
+		}
+	default:
+		return nullptr;
+	}
+}
+
+template <arr_reduce Op>
+ast* builtin_reduce(heap& mem, std::vector<ast*> const& as)
+{
+	size_t const arity = Op == arr_reduce::dot ? 2 : 1;
+	if (as.size() != arity) return nullptr;
+	for (auto a : as)
+	{
+		if (a == nullptr || a->type != ast::ast_type::data_arr) return nullptr;
+	}
+	auto& a = reinterpret_cast<data_arr*>(as[0])->value;
+	auto& b = reinterpret_cast<data_arr*>(as.back())->value;
+	if (a.size() != b.size() || (a.empty() && (Op == arr_reduce::min || Op == arr_reduce::max))) return nullptr;
+	return mem.make<data_num>(simd_kernels::get().reduce(Op, a.data(), b.data(), a.size()));
+}
+
+inline ast* builtin_object(heap& mem, std::vector<ast*> const& as)
+{
+	if (as.size() % 2 != 0) return nullptr;
+	auto shp = shape::root();
+	std::vector<ast*> slots;
+	for (size_t i = 0; i < as.size(); i += 2)
+	{
+		if (as[i] == nullptr || as[i]->type != ast::ast_type::data_str) return nullptr;
+		auto const& key = reinterpret_cast<data_str*>(as[i])->str();
+		if (auto const slot = shp->find(key); slot != shape::npos)
+		{
+			slots[slot] = as[i + 1];
+			continue;
+		}
+		shp = shp->with_key(key);
+		slots.push_back(as[i + 1]);
+	}
+	return mem.make<data_obj>(shp, slots);
+}
+
+inline ast* builtin_with(heap& mem, std::vector<ast*> const& as)
+{
+	if (as.size() != 3 || as[0] == nullptr || as[0]->type != ast::ast_type::data_obj
+		|| as[1] == nullptr || as[1]->type != ast::ast_type::data_str)
+	{
+		return nullptr;
+	}
+	auto o = reinterpret_cast<data_obj*>(as[0]);
+	auto const& key = reinterpret_cast<data_str*>(as[1])->str();
+	auto res = mem.make<data_obj>(o->shp, o->slots);
+	if (auto const slot = o->shp->find(key); slot != shape::npos)
+	{
+		res->slots[slot] = as[2];
+	}
+	else
+	{
+		res->shp = o->shp->with_key(key);
+		res->slots.push_back(as[2]);
+	}
+	return res;
+}
+
+// Tasks and channels, defined with the scheduler.
+inline ast* builtin_spawn(heap& mem, std::vector<ast*> const& as);
+inline ast* builtin_await(heap& mem, std::vector<ast*> const& as);
+inline ast* builtin_channel(heap& mem, std::vector<ast*> const& as);
+inline ast* builtin_send(heap& mem, std::vector<ast*> const& as);
+inline ast* builtin_recv(heap& mem, std::vector<ast*> const& as);
+inline ast* builtin_close(heap& mem, std::vector<ast*> const& as);
+inline ast* builtin_read(heap& mem, std::vector<ast*> const& as);
+
+inline std::unordered_map<uint32_t, native*> const& builtins()
+{
+	static std::unordered_map<uint32_t, native*> const table = []
+	{
+		std::unordered_map<uint32_t, native*> t;
+		for (auto n : {
+			new native{ "range", builtin_range },
+			new native{ "array", builtin_array },
+			new native{ "sum", builtin_reduce<arr_reduce::sum> },
+			new native{ "min", builtin_reduce<arr_reduce::min> },
+			new native{ "max", builtin_reduce<arr_reduce::max> },
+			new native{ "dot", builtin_reduce<arr_reduce::dot> },
+			new native{ "object", builtin_object },
+			new native{ "with", builtin_with },
+			new native{ "spawn", builtin_spawn },
+			new native{ "await", builtin_await },
+			new native{ "channel", builtin_channel },
+			new native{ "send", builtin_send },
+			new native{ "recv", builtin_recv },
+			new native{ "close", builtin_close },
+			new native{ "read", builtin_read } })
+		{
+			t[symbol_id(n->name)] = n;
+		}
+		return t;
+	}();
+	return table;
+}
+
+inline native* find_builtin(uint32_t name)
+{
+	auto& table = builtins();
+	auto it = table.find(name);
+	return it == std::end(table) ? nullptr : it->second;
+}
+
+// Rewrites a parsed program before it runs. The passes are:
+// - inline_calls: a call to a small lambda that is bound once at the top
+//   level, before the call, becomes the lambda's body. When the body is one
+//   expression without calls, the arguments are substituted into it;
+//   otherwise it becomes a block that first binds the parameters.
+// - dead_code: statements whose value is dropped and that can have no
+//   effect are removed.
+// - hoist: an operation in a `for` body that reads nothing the loop binds is
+//   computed once, into a temporary, before the loop.
+// A name bound only by top-level statements resolves to the same binding on
+// both backends wherever it is read, so inlined bodies may read no other
+// free names. Their own parameters and locals must be bound nowhere else:
+// the closure backend reads a null slot through to the next binding of the
+// name, which moves when the body moves. `while` is left alone, as neither
+// backend runs it yet.
+struct optimizer
+{
+	struct passes
+	{
+		bool inline_calls{ true };
+		bool dead_code{ true };
+		bool hoist{ true };
+	};
+	struct report
+	{
+		size_t inlined_calls{ 0 };
+		size_t removed_statements{ 0 };
+		size_t hoisted_expressions{ 0 };
+	};
+
+	passes enabled;
+	size_t inline_limit{ 32 };
+
+	report run(ast* root)
+	{
+		report res;
+		if (root == nullptr || root->type != ast::ast_type::body) return res;
+		auto top = reinterpret_cast<body_*>(root);
+		parse_lazy_bodies(top);
+		if (enabled.inline_calls) inline_calls(top, res);
+		if (enabled.dead_code) remove_dead_code(top, res);
+		if (enabled.hoist) hoist_invariants(top, res);
+		return res;
+	}
+
+private:
+	struct lambda
+	{
+		func* f;
+		size_t defined_at;
+		bool planned{ false };
+		bool inlinable{ false };
+		bool substitute{ false };
+	};
+
+	std::unordered_map<uint32_t, size_t> top_binds;
+	std::unordered_map<uint32_t, size_t> all_binds;
+	std::unordered_set<uint32_t> inner_binds;
+	std::unordered_map<uint32_t, lambda> lambdas;
+	size_t temps{ 0 };
+
+	template <typename F>
+	static void for_each_slot(ast* n, F&& f)
+	{
+		auto visit = [&f](ast*& c)
+		{
+			if (c != nullptr) f(c);
+		};
+		switch (n->type)
+		{
+		case ast::ast_type::operation:
+			visit(reinterpret_cast<operation*>(n)->l);
+			visit(reinterpret_cast<operation*>(n)->r);
+			break;
+		case ast::ast_type::ite:
+			visit(reinterpret_cast<ITE*>(n)->p);
+			visit(reinterpret_cast<ITE*>(n)->t);
+			visit(reinterpret_cast<ITE*>(n)->e);
+			break;
+		case ast::ast_type::for_loop:
+			visit(reinterpret_cast<for_loop*>(n)->rng);
+			visit(reinterpret_cast<for_loop*>(n)->b);
+			break;
+		case ast::ast_type::whl_loop:
+			visit(reinterpret_cast<whl_loop*>(n)->p);
+			visit(reinterpret_cast<whl_loop*>(n)->b);
+			break;
+		case ast::ast_type::body:
+			for (auto& stmt : reinterpret_cast<body_*>(n)->stmts) visit(stmt);
+			break;
+		case ast::ast_type::func:
+			visit(reinterpret_cast<func*>(n)->b);
+			break;
+		case ast::ast_type::call:
+			visit(reinterpret_cast<call_*>(n)->src);
+			for (auto& a : reinterpret_cast<call_*>(n)->as) visit(a);
+			break;
+		case ast::ast_type::assign:
+			visit(reinterpret_cast<assign*>(n)->v);
+			break;
+		default:
+			break;
+		}
+	}
+
+	// The key of `o.key` is not a read.
+	static bool is_key(operation* o)
+	{
+		return o->op == "." && o->r != nullptr && o->r->type == ast::ast_type::symbol;
+	}
+
+	template <typename F>
+	static void for_each_read(ast* n, F&& f)
+	{
+		if (n->type == ast::ast_type::symbol)
+		{
+			f(reinterpret_cast<sym*>(n)->sym_id);
+			return;
+		}
+		if (n->type == ast::ast_type::operation && is_key(reinterpret_cast<operation*>(n)))
+		{
+			for_each_read(reinterpret_cast<operation*>(n)->l, f);
+			return;
+		}
+		for_each_slot(n, [&f](ast*& c) { for_each_read(c, f); });
+	}
+
+	static size_t count_nodes(ast* n)
+	{
+		size_t res = 1;
+		visit_children(n, [&res](ast* c) { res += count_nodes(c); });
+		return res;
+	}
+
+	static bool has_call(ast* n)
+	{
+		bool res = n->type == ast::ast_type::call;
+		visit_children(n, [&res](ast* c) { res = res || has_call(c); });
+		return res;
+	}
+
+	// Operations, calls, names and literals only.
+	static bool plain_expression(ast* n)
+	{
+		switch (n->type)
+		{
+		case ast::ast_type::operation:
+		case ast::ast_type::call:
+			{
+				bool res = true;
+				visit_children(n, [&res](ast* c) { res = res && plain_expression(c); });
+				return res;
+			}
+		case ast::ast_type::symbol:
+		case ast::ast_type::number:
+		case ast::ast_type::string:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Dropping the value of a pure statement changes nothing.
+	static bool pure(ast* n)
+	{
+		switch (n->type)
+		{
+		case ast::ast_type::operation:
+			{
+				auto o = reinterpret_cast<operation*>(n);
+				return pure(o->l) && (o->r == nullptr || pure(o->r));
+			}
+		case ast::ast_type::symbol:
+		case ast::ast_type::number:
+		case ast::ast_type::string:
+		case ast::ast_type::func:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	static bool trivial(ast* n)
+	{
+		return n->type == ast::ast_type::symbol || n->type == ast::ast_type::number || n->type == ast::ast_type::string;
+	}
+
+	void collect_bindings(ast* n, bool at_top)
+	{
+		auto bind = [this, at_top](uint32_t name)
+		{
+			if (at_top) ++top_binds[name];
+			else inner_binds.insert(name);
+			++all_binds[name];
+		};
+		switch (n->type)
+		{
+		case ast::ast_type::assign:
+			bind(reinterpret_cast<assign*>(n)->sym_id);
+			break;
+		case ast::ast_type::for_loop:
+			bind(reinterpret_cast<for_loop*>(n)->sym_id);
+			break;
+		case ast::ast_type::func:
+			for (auto a : reinterpret_cast<func*>(n)->sym_ids)
+			{
+				inner_binds.insert(a);
+				++all_binds[a];
+			}
+			break;
+		default:
+			break;
+		}
+		bool const nested = n->type == ast::ast_type::body || n->type == ast::ast_type::func;
+		visit_children(n, [this, at_top, nested](ast* c) { collect_bindings(c, at_top && !nested); });
+	}
+
+	bool global_only(uint32_t name) const
+	{
+		return !inner_binds.count(name);
+	}
+
+	void inline_calls(body_* top, report& res)
+	{
+		top_binds.clear();
+		all_binds.clear();
+		inner_binds.clear();
+		lambdas.clear();
+		for (auto stmt : top->stmts)
+		{
+			collect_bindings(stmt, true);
+		}
+		for (size_t i = 0; i < top->stmts.size(); ++i)
+		{
+			if (top->stmts[i]->type != ast::ast_type::assign) continue;
+			auto a = reinterpret_cast<assign*>(top->stmts[i]);
+			if (a->v->type == ast::ast_type::func && top_binds[a->sym_id] == 1 && global_only(a->sym_id))
+			{
+				lambdas.insert({ a->sym_id, lambda{ reinterpret_cast<func*>(a->v), i } });
+			}
+		}
+		for (size_t i = 0; i < top->stmts.size(); ++i)
+		{
+			inline_in(top->stmts[i], i, res);
+		}
+	}
+
+	void inline_in(ast*& slot, size_t at, report& res)
+	{
+		for_each_slot(slot, [this, at, &res](ast*& c) { inline_in(c, at, res); });
+		if (slot->type != ast::ast_type::call) return;
+		auto c = reinterpret_cast<call_*>(slot);
+		if (c->src->type != ast::ast_type::symbol) return;
+		auto it = lambdas.find(reinterpret_cast<sym*>(c->src)->sym_id);
+		if (it == std::end(lambdas) || it->second.defined_at >= at) return;
+		auto& l = it->second;
+		if (!l.planned) plan(it->first, l);
+		if (!l.inlinable || c->as.size() != l.f->as.size()) return;
+
+		auto const& params = l.f->sym_ids;
+		auto& stmts = reinterpret_cast<body_*>(l.f->b)->stmts;
+		ast* replacement = nullptr;
+		// Substituted arguments run in the body's operand order, so only
+		// those without calls may move; the rest are assigned in order.
+		bool substituted = l.substitute;
+		std::unordered_map<uint32_t, ast*> args;
+		if (substituted)
+		{
+			std::unordered_map<uint32_t, size_t> uses;
+			for_each_read(stmts[0], [&uses](uint32_t name) { ++uses[name]; });
+			for (size_t k = 0; k < params.size() && substituted; ++k)
+			{
+				substituted = trivial(c->as[k]) || (!has_call(c->as[k]) && uses[params[k]] == 1);
+				args[params[k]] = c->as[k];
+			}
+		}
+		if (substituted)
+		{
+			replacement = clone_tree(stmts[0]);
+			substitute(replacement, args);
+		}
+		else
+		{
+			for (size_t k = 1; k < params.size(); ++k)
+			{
+				bool clash = has_call(c->as[k]);
+				for_each_read(c->as[k], [&](uint32_t name)
+				{
+					clash = clash || std::find(std::begin(params), std::begin(params) + k, name) != std::begin(params) + k;
+				});
+				if (clash) return;
+			}
+			auto b = new body_();
+			for (size_t k = 0; k < params.size(); ++k)
+			{
+				b->stmts.push_back(new assign(l.f->as[k], params[k], clone_tree(c->as[k])));
+			}
+			for (auto stmt : stmts)
+			{
+				b->stmts.push_back(clone_tree(stmt));
+			}
+			replacement = b;
+		}
+		delete_tree(slot);
+		slot = replacement;
+		++res.inlined_calls;
+	}
+
+	void plan(uint32_t name, lambda& l)
+	{
+		l.planned = true;
+		auto f = l.f;
+		std::unordered_set<uint32_t> bound(std::begin(f->sym_ids), std::end(f->sym_ids));
+		if (f->b == nullptr || f->b->type != ast::ast_type::body || bound.size() != f->sym_ids.size()) return;
+		auto& stmts = reinterpret_cast<body_*>(f->b)->stmts;
+		if (stmts.empty() || count_nodes(f->b) > inline_limit) return;
+		for (auto stmt : stmts)
+		{
+			auto e = stmt->type == ast::ast_type::assign ? reinterpret_cast<assign*>(stmt)->v : stmt;
+			if (!plain_expression(e)) return;
+			bool ok = true;
+			for_each_read(e, [&](uint32_t id) { ok = ok && id != name && (bound.count(id) || global_only(id)); });
+			if (!ok) return;
+			if (stmt->type == ast::ast_type::assign) bound.insert(reinterpret_cast<assign*>(stmt)->sym_id);
+		}
+		std::unordered_map<uint32_t, size_t> own;
+		for (auto a : f->sym_ids) ++own[a];
+		for (auto stmt : stmts)
+		{
+			if (stmt->type == ast::ast_type::assign) ++own[reinterpret_cast<assign*>(stmt)->sym_id];
+		}
+		for (auto& [id, n] : own)
+		{
+			if (all_binds[id] != n || find_builtin(id) != nullptr) return;
+		}
+		l.inlinable = true;
+		l.substitute = stmts.size() == 1 && stmts[0]->type != ast::ast_type::assign && !has_call(stmts[0]);
+	}
+
+	static void substitute(ast*& slot, std::unordered_map<uint32_t, ast*> const& args)
+	{
+		if (slot->type == ast::ast_type::symbol)
+		{
+			if (auto it = args.find(reinterpret_cast<sym*>(slot)->sym_id); it != std::end(args))
+			{
+				delete slot;
+				slot = clone_tree(it->second);
+			}
+			return;
+		}
+		if (slot->type == ast::ast_type::operation && is_key(reinterpret_cast<operation*>(slot)))
+		{
+			substitute(reinterpret_cast<operation*>(slot)->l, args);
+			return;
+		}
+		for_each_slot(slot, [&args](ast*& c) { substitute(c, args); });
+	}
+
+	void remove_dead_code(ast* n, report& res)
+	{
+		if (n->type == ast::ast_type::body)
+		{
+			auto& stmts = reinterpret_cast<body_*>(n)->stmts;
+			size_t kept = 0;
+			for (size_t i = 0; i < stmts.size(); ++i)
+			{
+				if (i + 1 < stmts.size() && pure(stmts[i]))
+				{
+					delete_tree(stmts[i]);
+					++res.removed_statements;
+					continue;
+				}
+				stmts[kept++] = stmts[i];
+			}
+			stmts.resize(kept);
+		}
+		visit_children(n, [this, &res](ast* c) { remove_dead_code(c, res); });
+	}
+
+	static void collect_binds_in(ast* n, std::unordered_set<uint32_t>& names)
+	{
+		if (n->type == ast::ast_type::assign) names.insert(reinterpret_cast<assign*>(n)->sym_id);
+		if (n->type == ast::ast_type::for_loop) names.insert(reinterpret_cast<for_loop*>(n)->sym_id);
+		if (n->type == ast::ast_type::func) return;
+		visit_children(n, [&names](ast* c) { collect_binds_in(c, names); });
+	}
+
+	static bool invariant(ast* n, std::unordered_set<uint32_t> const& bound)
+	{
+		switch (n->type)
+		{
+		case ast::ast_type::number:
+		case ast::ast_type::string:
+			return true;
+		case ast::ast_type::symbol:
+			return !bound.count(reinterpret_cast<sym*>(n)->sym_id);
+		case ast::ast_type::operation:
+			{
+				auto o = reinterpret_cast<operation*>(n);
+				return invariant(o->l, bound) && (o->r == nullptr || is_key(o) || invariant(o->r, bound));
+			}
+		default:
+			return false;
+		}
+	}
+
+	// Moves the invariant operations under n into temporaries bound by
+	// `hoisted`, leaving reads of the temporaries behind.
+	void hoist_from(ast*& slot, std::unordered_set<uint32_t> const& bound, std::vector<ast*>& hoisted)
+	{
+		switch (slot->type)
+		{
+		case ast::ast_type::func:
+		case ast::ast_type::ite:
+		case ast::ast_type::whl_loop:
+			return;
+		case ast::ast_type::operation:
+			if (invariant(slot, bound))
+			{
+				auto const name = "%t" + std::to_string(temps++);
+				auto const id = symbol_id(name);
+				hoisted.push_back(new assign(name, id, slot));
+				slot = new sym(name, id);
+				return;
+			}
+			if (slot->pooled)
+			{
+				// other trees share it: rewrite a copy
+				auto o = reinterpret_cast<operation*>(slot);
+				ast* l = o->l;
+				ast* r = o->r;
+				hoist_from(l, bound, hoisted);
+				hoist_from(r, bound, hoisted);
+				if (l != o->l || r != o->r) slot = new operation(o->op, l, r);
+				return;
+			}
+			break;
+		default:
+			break;
+		}
+		for_each_slot(slot, [&](ast*& c) { hoist_from(c, bound, hoisted); });
+	}
+
+	void hoist_invariants(ast* n, report& res)
+	{
+		if (n->type == ast::ast_type::body)
+		{
+			auto& stmts = reinterpret_cast<body_*>(n)->stmts;
+			for (size_t i = 0; i < stmts.size(); ++i)
+			{
+				auto loop = stmts[i];
+				if (loop->type == ast::ast_type::assign) loop = reinterpret_cast<assign*>(loop)->v;
+				if (loop->type != ast::ast_type::for_loop) continue;
+				auto fr = reinterpret_cast<for_loop*>(loop);
+				std::unordered_set<uint32_t> bound{ fr->sym_id };
+				collect_binds_in(fr->b, bound);
+				std::vector<ast*> hoisted;
+				hoist_from(fr->b, bound, hoisted);
+				stmts.insert(std::begin(stmts) + i, std::begin(hoisted), std::end(hoisted));
+				i += hoisted.size();
+				res.hoisted_expressions += hoisted.size();
+			}
+		}
+		visit_children(n, [this, &res](ast* c) { hoist_invariants(c, res); });
+	}
+};
+
+// Streams the elements of a sequence value one at a time, so lazy sequences
+// such as ranges never have to be materialized into a data_vec.
+struct value_iterator
+{
+	ast* src;
+	size_t n;
+	size_t i{ 0 };
+
+	value_iterator(ast* seq) : src(seq), n(length(seq))
+	{
+	}
+
+	static size_t length(ast* seq)
+	{
+		if (seq == nullptr) return 0;
+		switch (seq->type)
+		{
+		case ast::ast_type::data_vec: return reinterpret_cast<data_vec*>(seq)->value.size();
+		case ast::ast_type::data_rng: return reinterpret_cast<data_rng*>(seq)->size();
+		case ast::ast_type::data_arr: return reinterpret_cast<data_arr*>(seq)->value.size();
+		case ast::ast_type::data_str: return reinterpret_cast<data_str*>(seq)->str().size();
+		case ast::ast_type::data_obj: return reinterpret_cast<data_obj*>(seq)->shp->keys.size();
+		default: return 0;
+		}
+	}
+
+	// Element k, allocated in mem when the sequence does not hold it as a
+	// value already; k must be below n.
+	ast* at(heap& mem, size_t k) const
+	{
+		switch (src->type)
+		{
+		case ast::ast_type::data_vec:
+			return reinterpret_cast<data_vec*>(src)->value[k];
+		case ast::ast_type::data_rng:
+			{
+				auto r = reinterpret_cast<data_rng*>(src);
+				return mem.make<data_num>(r->start + static_cast<double>(k) * r->step);
+			}
+		case ast::ast_type::data_arr:
+			return mem.make<data_num>(reinterpret_cast<data_arr*>(src)->value[k]);
+		case ast::ast_type::data_str:
+			return mem.make<data_str>(std::string(1, reinterpret_cast<data_str*>(src)->str()[k]));
+		case ast::ast_type::data_obj:
+			return mem.make<data_str>(reinterpret_cast<data_obj*>(src)->shp->keys[k]);
+		default:
+			return nullptr;
+		}
+	}
+
+	bool next(heap& mem, ast*& out)
+	{
+		if (i >= n) return false;
+		out = at(mem, i++);
+		return true;
+	}
+};
+
+// Fixed-size pool of workers, each with its own task deque. Workers take
+// from the back of their own deque and steal from the front of the others';
+// a thread waiting in parallel_for runs queued tasks instead of blocking, so
+// parallel_for may be nested inside a task.
+struct thread_pool
+{
+	explicit thread_pool(size_t n)
+	{
+		n = std::max<size_t>(n, 1);
+		for (size_t i = 0; i < n; ++i)
+		{
+			queues.push_back(std::make_unique<task_queue>());
+		}
+		for (size_t i = 0; i < n; ++i)
+		{
+			workers.emplace_back([this, i] { work(i); });
+		}
+	}
+	thread_pool(thread_pool const&) = delete;
+	thread_pool& operator=(thread_pool const&) = delete;
+
+	~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+		}
+		wake.notify_all();
+		for (auto& w : workers)
+		{
+			w.join();
+		}
+	}
+
+	size_t size() const
+	{
+		return workers.size();
+	}
+
+	void parallel_for(size_t n, std::function<void(size_t)> const& f)
+	{
+		std::atomic<size_t> remaining{ n };
+		std::exception_ptr error;
+		std::mutex error_lock;
+		for (size_t i = 0; i < n; ++i)
+		{
+			push(i % queues.size(), [&, i]
+			{
+				try
+				{
+					f(i);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> guard(error_lock);
+					if (!error) error = std::current_exception();
+				}
+				if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					wake.notify_all();
+				}
+			});
+		}
+		while (remaining.load(std::memory_order_acquire) != 0)
+		{
+			if (run_one(current == nullptr ? 0 : current_index)) continue;
+			// nothing left to steal: sleep until the last task is done or
+			// more work is queued
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [&remaining, this]
+			{
+				return remaining.load(std::memory_order_acquire) == 0 || pending.load(std::memory_order_acquire) != 0;
+			});
+		}
+		if (error) std::rethrow_exception(error);
+	}
+
+	// Queues task and returns at once.
+	void post(std::function<void()> task)
+	{
+		push(posted.fetch_add(1, std::memory_order_relaxed) % queues.size(), std::move(task));
+	}
+
+	static size_t hardware_threads()
+	{
+		return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+
+	// Pool used by `par for`, started on first use.
+	static thread_pool& shared()
+	{
+		static thread_pool pool(hardware_threads());
+		return pool;
+	}
+
+private:
+	struct task_queue
+	{
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<task_queue>> queues;
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::atomic<size_t> pending{ 0 };
+	std::atomic<size_t> posted{ 0 };
+	bool stop{ false };
+
+	static thread_local thread_pool* current;
+	static thread_local size_t current_index;
+
+	void push(size_t q, std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> guard(queues[q]->lock);
+			queues[q]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			pending.fetch_add(1, std::memory_order_release);
+		}
+		wake.notify_one();
+	}
+
+	bool run_one(size_t self)
+	{
+		std::function<void()> task;
+		for (size_t k = 0; k < queues.size() && !task; ++k)
+		{
+			auto& q = *queues[(self + k) % queues.size()];
+			std::lock_guard<std::mutex> guard(q.lock);
+			if (q.tasks.empty()) continue;
+			if (k == 0)
+			{
+				task = std::move(q.tasks.back());
+				q.tasks.pop_back();
+			}
+			else
+			{
+				task = std::move(q.tasks.front());
+				q.tasks.pop_front();
+			}
+		}
+		if (!task) return false;
+		pending.fetch_sub(1, std::memory_order_acq_rel);
+		task();
+		return true;
+	}
+
+	void work(size_t index)
+	{
+		current = this;
+		current_index = index;
+		for (;;)
+		{
+			if (run_one(index)) continue;
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [this] { return stop || pending.load(std::memory_order_acquire) != 0; });
+			if (stop) return;
+		}
+	}
+};
+
+thread_local thread_pool* thread_pool::current{ nullptr };
+thread_local size_t thread_pool::current_index{ 0 };
+
+// Copies the parts of v whose owner satisfies `owned` into `to`; anything
+// else is shared as is.
+template <typename Owned>
+ast* copy_value(heap& to, ast* v, Owned const& owned)
+{
+	if (!is_data(v) || !owned(static_cast<gc_object*>(v)->owner)) return v;
+	switch (v->type)
+	{
+	case ast::ast_type::data_num:
+		return to.make<data_num>(reinterpret_cast<data_num*>(v)->value);
+	case ast::ast_type::data_str:
+		return to.make<data_str>(reinterpret_cast<data_str*>(v)->str());
+	case ast::ast_type::data_vec:
+		{
+			auto values = reinterpret_cast<data_vec*>(v)->value;
+			for (auto& e : values)
+			{
+				e = copy_value(to, e, owned);
+			}
+			return to.make<data_vec>(values);
+		}
+	case ast::ast_type::data_obj:
+		{
+			auto o = reinterpret_cast<data_obj*>(v);
+			auto slots = o->slots;
+			for (auto& e : slots)
+			{
+				e = copy_value(to, e, owned);
+			}
+			return to.make<data_obj>(o->shp, slots);
+		}
+	case ast::ast_type::data_rng:
+		{
+			auto r = reinterpret_cast<data_rng*>(v);
+			return to.make<data_rng>(r->start, r->stop, r->step);
+		}
+	case ast::ast_type::data_arr:
+		{
+			auto& src = reinterpret_cast<data_arr*>(v)->value;
+			auto a = to.make<data_arr>(src.size());
+			std::copy(std::begin(src), std::end(src), std::begin(a->value));
+			return a;
+		}
+	case ast::ast_type::data_chan:
+		return to.make<data_chan>(reinterpret_cast<data_chan*>(v)->ch);
+	default:
+		return v;
+	}
+}
+
+// Copies a value owned by `from` into `to`; anything else (values of other
+// heaps, the strings of literals) is shared as is.
+inline ast* adopt(heap& to, heap const& from, ast* v)
+{
+	return copy_value(to, v, [&from](heap const* owner) { return owner == &from; });
+}
+
+// Copies every part of v that a heap other than `to` owns, so the copy does
+// not depend on the heap it came from.
+inline ast* transfer(heap& to, ast* v)
+{
+	return copy_value(to, v, [&to](heap const* owner) { return owner != nullptr && owner != &to; });
+}
+
+// Runs run(mem, lo, hi, out) over chunks of [0, n) on the shared pool, each
+// chunk with a heap of its own, and collects the values appended to out into
+// one data_vec of dst in index order. The chunks may read, but not allocate
+// in, dst while they run. What is left of dst's budget is split evenly
+// between the chunks, and their tallies are added to dst's.
+template <typename F>
+ast* parallel_map(heap& dst, size_t n, F const& run)
+{
+	struct chunk
+	{
+		heap mem;
+		std::vector<ast*> out;
+	};
+	auto& pool = thread_pool::shared();
+	size_t const chunks = std::min(n, pool.size() * 4);
+	size_t share = 0;
+	if (dst.heap_limit != 0 && chunks != 0)
+	{
+		auto const used = dst.budget_bytes();
+		share = std::max<size_t>((used < dst.heap_limit ? dst.heap_limit - used : 0) / chunks, 1);
+	}
+	std::vector<std::unique_ptr<chunk>> parts;
+	for (size_t c = 0; c < chunks; ++c)
+	{
+		auto& part = *parts.emplace_back(std::make_unique<chunk>());
+		part.mem.nursery_limit = dst.nursery_limit;
+		part.mem.heap_limit = share;
+		part.mem.tasks = dst.tasks;
+		part.mem.frames.push_back(&part.out);
+	}
+	pool.parallel_for(chunks, [&](size_t c)
+	{
+		run(parts[c]->mem, n * c / chunks, n * (c + 1) / chunks, parts[c]->out);
+	});
+
+	// The chunks ran side by side, so their peaks add up on top of what dst
+	// held meanwhile.
+	for (size_t k = 0; k < dst.memory.size(); ++k)
+	{
+		auto& u = dst.memory[k];
+		size_t peak = 0;
+		for (auto& part : parts)
+		{
+			u.total_objects += part->mem.memory[k].total_objects;
+			peak += part->mem.memory[k].peak_bytes;
+		}
+		u.peak_bytes = std::max(u.peak_bytes, u.live_bytes + peak);
+	}
+
+	std::vector<ast*> values;
+	values.reserve(n);
+	for (auto& part : parts)
+	{
+		for (auto v : part->out)
+		{
+			values.push_back(adopt(dst, part->mem, v));
+		}
+	}
+	return dst.make<data_vec>(values);
+}
+
+// Thrown inside a parked task when its group gives up on it, so that the
+// task's stack unwinds.
+struct task_cancelled
+{
+};
+
+struct task;
+
+// A party blocked on a channel or a read: a parked task, or a thread that
+// runs no task.
+struct waiter
+{
+	task* t{ nullptr };
+	// what the waiter holds while it checks whether it is done waiting;
+	// whoever wakes it holds this too
+	std::mutex* lock{ nullptr };
+	// the group a thread waits in; it sleeps on the group's idle
+	task_group* group{ nullptr };
+	std::condition_variable cv;
+	std::atomic<bool> woken{ false };
+};
+
+// The tasks spawned by one run. A task is active while it is queued or
+// running, and parked while it waits.
+struct task_group
+{
+	std::mutex lock;
+	std::condition_variable idle;
+	std::unordered_set<task*> live;
+	size_t active{ 0 };
+	size_t reads{ 0 };
+	// threads waiting on a channel or a read, in the order they blocked
+	std::deque<waiter*> blocked;
+	std::exception_ptr error;
+
+	task_group() = default;
+	task_group(task_group const&) = delete;
+	task_group& operator=(task_group const&) = delete;
+	~task_group()
+	{
+		try
+		{
+			finish();
+		}
+		catch (...)
+		{
+		}
+	}
+
+	// No task can run until a blocked thread wakes one.
+	bool stuck() const
+	{
+		return active == 0 && reads == 0;
+	}
+
+	// Waits for every task; tasks left parked with nothing to wake them are
+	// cancelled. Rethrows the first error a task raised.
+	void finish();
+};
+
+struct task
+{
+	task_group* group{ nullptr };
+	heap mem;
+	std::vector<ast*> args;
+	heap::task_body body;
+	std::shared_ptr<channel> result;
+	std::atomic<bool> cancelled{ false };
+	// set while the task is parked
+	waiter* waiting{ nullptr };
+#if defined(AYNANA_FIBERS)
+	ucontext_t context;
+	char* stack{ nullptr };
+	std::mutex* handoff{ nullptr };
+	bool done{ false };
+#endif
+
+	void run();
+	// Records e as the group's error and delivers no result.
+	void fail(std::exception_ptr e);
+};
+
+// Runs tasks. With fibers every task gets a stack of its own, and a few
+// workers switch between the tasks that are ready, so a parked task holds
+// no thread. Elsewhere every task runs on a thread of its own.
+struct task_scheduler
+{
+	static task_scheduler& shared()
+	{
+		static task_scheduler sched(thread_pool::hardware_threads());
+		return sched;
+	}
+
+	// Threads that do the reads of parked tasks.
+	static thread_pool& io()
+	{
+		static thread_pool pool(2);
+		return pool;
+	}
+
+	// The task this thread runs, null outside tasks. With fibers it is read
+	// through a call that is not inlined and has a barrier: a fiber may
+	// resume on another worker, and a thread-local address kept from before
+	// the switch would be the old worker's.
+#if defined(AYNANA_FIBERS)
+	__attribute__((noinline)) static task*& running()
+	{
+		static thread_local task* t{ nullptr };
+		asm volatile("" ::: "memory");
+		return t;
+	}
+#else
+	static task*& running()
+	{
+		static thread_local task* t{ nullptr };
+		return t;
+	}
+#endif
+
+	task_scheduler(task_scheduler const&) = delete;
+	task_scheduler& operator=(task_scheduler const&) = delete;
+
+	// Wakes w once; a parked task becomes active again.
+	void resume(waiter& w)
+	{
+		auto const g = w.group;
+		if (w.woken.exchange(true)) return;
+		if (w.t == nullptr)
+		{
+			std::lock_guard<std::mutex> guard(g->lock);
+			g->idle.notify_all();
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(w.t->group->lock);
+			++w.t->group->active;
+		}
+#if defined(AYNANA_FIBERS)
+		make_ready(w.t);
+#else
+		w.cv.notify_all();
+#endif
+	}
+
+	// The group counts t as active until it is deleted.
+	static void finished(task* t)
+	{
+		auto g = t->group;
+		{
+			std::lock_guard<std::mutex> guard(g->lock);
+			g->live.erase(t);
+		}
+		delete t;
+		std::lock_guard<std::mutex> guard(g->lock);
+		--g->active;
+		g->idle.notify_all();
+	}
+
+	static void parked(task* t, waiter* w)
+	{
+		std::lock_guard<std::mutex> guard(t->group->lock);
+		t->waiting = w;
+		if (w != nullptr)
+		{
+			--t->group->active;
+			t->group->idle.notify_all();
+		}
+	}
+
+#if defined(AYNANA_FIBERS)
+	// as large as a thread's stack, so a task recurses as deep as a script;
+	// only the pages it touches are committed
+	static constexpr size_t stack_bytes = 8 << 20;
+	// room left below the floor for the frames between two calls
+	static constexpr size_t stack_margin = 256 << 10;
+
+	explicit task_scheduler(size_t n)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			workers.emplace_back([this] { work(); });
+		}
+	}
+	~task_scheduler()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stop = true;
+		}
+		wake.notify_all();
+		for (auto& w : workers)
+		{
+			w.join();
+		}
+		for (auto s : spare)
+		{
+			munmap(s, stack_bytes);
+		}
+	}
+
+	void start(task* t)
+	{
+		make_ready(t);
+	}
+
+	// Parks the running task until w is resumed. held is released once the
+	// task is off its stack and locked again when it runs on.
+	void park(std::unique_lock<std::mutex>& held, waiter& w)
+	{
+		auto t = w.t;
+		parked(t, &w);
+		auto m = held.release();
+		t->handoff = m;
+		swapcontext(&t->context, home());
+		held = std::unique_lock<std::mutex>(*m);
+		parked(t, nullptr);
+	}
+
+private:
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<task*> ready;
+	std::vector<std::thread> workers;
+	bool stop{ false };
+	std::mutex spare_lock;
+	std::vector<char*> spare;
+
+	// The context of this worker's loop; read like running().
+	__attribute__((noinline)) static ucontext_t*& home()
+	{
+		static thread_local ucontext_t* c{ nullptr };
+		asm volatile("" ::: "memory");
+		return c;
+	}
+
+	void make_ready(task* t)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			ready.push_back(t);
+		}
+		wake.notify_one();
+	}
+
+	// Stacks grow down onto a guard page.
+	char* acquire_stack()
+	{
+		{
+			std::lock_guard<std::mutex> guard(spare_lock);
+			if (!spare.empty())
+			{
+				auto s = spare.back();
+				spare.pop_back();
+				return s;
+			}
+		}
+		auto p = mmap(nullptr, stack_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (p == MAP_FAILED) return nullptr;
+		mprotect(p, static_cast<size_t>(sysconf(_SC_PAGESIZE)), PROT_NONE);
+		return static_cast<char*>(p);
+	}
+
+	void release_stack(char* s)
+	{
+		std::lock_guard<std::mutex> guard(spare_lock);
+		if (spare.size() < 64) spare.push_back(s);
+		else munmap(s, stack_bytes);
+	}
+
+	static void entry()
+	{
+		auto t = running();
+		t->run();
+		t->done = true;
+		setcontext(home());
+	}
+
+	void work()
+	{
+		ucontext_t self;
+		home() = &self;
+		for (;;)
+		{
+			task* t = nullptr;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [this] { return stop || !ready.empty(); });
+				if (ready.empty()) return;
+				t = ready.front();
+				ready.pop_front();
+			}
+			if (t->stack == nullptr)
+			{
+				t->stack = acquire_stack();
+				if (t->stack == nullptr)
+				{
+					t->fail(std::make_exception_ptr(std::bad_alloc()));
+					finished(t);
+					continue;
+				}
+				getcontext(&t->context);
+				t->context.uc_stack.ss_sp = t->stack;
+				t->context.uc_stack.ss_size = stack_bytes;
+				t->mem.stack_floor = reinterpret_cast<uintptr_t>(t->stack) + stack_margin;
+				t->context.uc_link = nullptr;
+				makecontext(&t->context, &task_scheduler::entry, 0);
+			}
+			running() = t;
+			swapcontext(&self, &t->context);
+			running() = nullptr;
+			if (t->done)
+			{
+				release_stack(t->stack);
+				finished(t);
+			}
+			else if (auto m = std::exchange(t->handoff, nullptr); m != nullptr)
+			{
+				m->unlock();
+			}
+		}
+	}
+#else
+	explicit task_scheduler(size_t)
+	{
+	}
+
+	void start(task* t)
+	{
+		try
+		{
+			std::thread([t]
+			{
+				running() = t;
+				t->run();
+				finished(t);
+			}).detach();
+		}
+		catch (std::system_error const&)
+		{
+			t->fail(std::current_exception());
+			finished(t);
+		}
+	}
+
+	void park(std::unique_lock<std::mutex>& held, waiter& w)
+	{
+		parked(w.t, &w);
+		w.cv.wait(held, [&w] { return w.woken.load(); });
+		parked(w.t, nullptr);
+	}
+#endif
+};
+
+// Waits, with held locked, until ready() holds, entering list whenever it
+// has to block. A task parks. A thread blocks, and gives up with false once
+// every task of its group is parked and it is the only thread left to wake
+// them.
+template <typename F>
+bool wait_until(std::unique_lock<std::mutex>& held, std::deque<waiter*>& list, task_group* g, F const& ready)
+{
+	waiter w;
+	w.t = task_scheduler::running();
+	w.lock = held.mutex();
+	while (!ready())
+	{
+		w.woken = false;
+		if (w.t != nullptr)
+		{
+			if (w.t->cancelled) throw task_cancelled{};
+			list.push_back(&w);
+			task_scheduler::shared().park(held, w);
+			list.erase(std::remove(std::begin(list), std::end(list), &w), std::end(list));
+			continue;
+		}
+		if (g == nullptr) return false;
+		// The group wakes a blocked thread when it is resumed, and the first
+		// one once nothing else can run.
+		std::unique_lock<std::mutex> guard(g->lock);
+		if (g->stuck() && g->blocked.empty()) return false;
+		w.group = g;
+		list.push_back(&w);
+		g->blocked.push_back(&w);
+		held.unlock();
+		g->idle.wait(guard, [&w, g] { return w.woken.load() || (g->stuck() && g->blocked.front() == &w); });
+		g->blocked.erase(std::find(std::begin(g->blocked), std::end(g->blocked), &w));
+		g->idle.notify_all();
+		guard.unlock();
+		held.lock();
+		list.erase(std::remove(std::begin(list), std::end(list), &w), std::end(list));
+		if (!w.woken && !ready()) return false;
+	}
+	return true;
+}
+
+// Bounded queue of values. Queued values are copies that live in the
+// channel's own heap until a receiver copies them out.
+struct channel
+{
+	explicit channel(size_t n) : capacity(std::max<size_t>(n, 1))
+	{
+		mem.scan_roots = [this](std::vector<ast*>& gray)
+		{
+			gray.insert(std::end(gray), std::begin(items), std::end(items));
+		};
+	}
+	channel(channel const&) = delete;
+	channel& operator=(channel const&) = delete;
+
+	// Waits while the channel is full. False when it is closed, or the wait
+	// could never end.
+	bool send(task_group* g, ast* v)
+	{
+		std::unique_lock<std::mutex> held(lock);
+		if (!wait_until(held, senders, g, [this] { return closed || items.size() < capacity; }) || closed) return false;
+		items.push_back(transfer(mem, v));
+		wake_one(receivers);
+		return true;
+	}
+
+	// The next value, copied into `to`, waiting while the channel is empty
+	// and open; null once it is closed and drained. keep leaves the value to
+	// the next receiver.
+	ast* recv(heap& to, task_group* g, bool keep)
+	{
+		std::unique_lock<std::mutex> held(lock);
+		if (!wait_until(held, receivers, g, [this] { return closed || !items.empty(); }) || items.empty()) return nullptr;
+		auto v = adopt(to, mem, items.front());
+		if (keep)
+		{
+			wake_one(receivers);
+			return v;
+		}
+		items.pop_front();
+		wake_one(senders);
+		mem.safepoint();
+		return v;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closed = true;
+		wake_all();
+	}
+
+	// The last value a task's result channel gets.
+	void deliver(ast* v)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (v != nullptr) items.push_back(transfer(mem, v));
+		closed = true;
+		wake_all();
+	}
+
+private:
+	std::mutex lock;
+	size_t capacity;
+	bool closed{ false };
+	heap mem;
+	std::deque<ast*> items;
+	std::deque<waiter*> senders;
+	std::deque<waiter*> receivers;
+
+	// A waiter that finds its turn taken waits again, so one wake per value
+	// or free slot is enough.
+	void wake_one(std::deque<waiter*>& list)
+	{
+		if (list.empty()) return;
+		auto w = list.front();
+		list.pop_front();
+		task_scheduler::shared().resume(*w);
+	}
+
+	void wake_all()
+	{
+		for (auto list : { &senders, &receivers })
+		{
+			while (!list->empty())
+			{
+				wake_one(*list);
+			}
+		}
+	}
+};
+
+inline void task::run()
+{
+	ast* res = nullptr;
+	try
+	{
+		res = body(mem, args);
+	}
+	catch (task_cancelled const&)
+	{
+		res = nullptr;
+	}
+	catch (...)
+	{
+		fail(std::current_exception());
+		return;
+	}
+	result->deliver(res);
+	body = nullptr;
+}
+
+inline void task::fail(std::exception_ptr e)
+{
+	{
+		std::lock_guard<std::mutex> guard(group->lock);
+		if (!group->error) group->error = e;
+	}
+	result->deliver(nullptr);
+	body = nullptr;
+}
+
+inline void task_group::finish()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (!live.empty() || active != 0)
+	{
+		// One at a time: while nothing else runs, the waiter of a parked
+		// task stays valid until it is resumed.
+		waiter* parked = nullptr;
+		if (stuck() && blocked.empty())
+		{
+			for (auto t : live)
+			{
+				if (t->waiting != nullptr && !t->cancelled.exchange(true))
+				{
+					parked = t->waiting;
+					break;
+				}
+			}
+		}
+		if (parked == nullptr)
+		{
+			idle.wait(guard);
+			continue;
+		}
+		guard.unlock();
+		{
+			std::lock_guard<std::mutex> held(*parked->lock);
+			task_scheduler::shared().resume(*parked);
+		}
+		guard.lock();
+	}
+	if (error) std::rethrow_exception(std::exchange(error, nullptr));
+}
+
+inline channel* channel_of(ast* v)
+{
+	return v != nullptr && v->type == ast::ast_type::data_chan ? reinterpret_cast<data_chan*>(v)->ch.get() : nullptr;
+}
+
+// spawn(f, args...): runs f(args...) as a task and returns the channel its
+// result arrives on. The task sees copies of its arguments and the lambdas
+// and builtins bound where it was spawned; other values reach it through
+// arguments and channels.
+inline ast* builtin_spawn(heap& mem, std::vector<ast*> const& as)
+{
+	if (as.empty() || as[0] == nullptr || as[0]->type != ast::ast_type::func || !mem.launch || mem.tasks == nullptr) return nullptr;
+	auto t = new task;
+	t->group = mem.tasks;
+	t->mem.nursery_limit = mem.nursery_limit;
+	t->mem.heap_limit = mem.heap_limit;
+	t->mem.tasks = mem.tasks;
+	for (size_t i = 1; i < as.size(); ++i)
+	{
+		t->args.push_back(transfer(t->mem, as[i]));
+	}
+	t->body = mem.launch(reinterpret_cast<func*>(as[0]));
+	t->result = std::make_shared<channel>(1);
+	auto handle = mem.make<data_chan>(t->result);
+	{
+		std::lock_guard<std::mutex> guard(t->group->lock);
+		t->group->live.insert(t);
+		++t->group->active;
+	}
+	task_scheduler::shared().start(t);
+	return handle;
+}
+
+// await(t): the result of task t, or the next value of a channel, left in
+// place; null if the task failed or can never finish.
+inline ast* builtin_await(heap& mem, std::vector<ast*> const& as)
+{
+	auto ch = as.size() == 1 ? channel_of(as[0]) : nullptr;
+	return ch != nullptr ? ch->recv(mem, mem.tasks, true) : nullptr;
+}
+
+inline ast* builtin_channel(heap& mem, std::vector<ast*> const& as)
+{
+	if (as.size() != 1 || as[0] == nullptr || as[0]->type != ast::ast_type::data_num) return nullptr;
+	auto const n = reinterpret_cast<data_num*>(as[0])->value;
+	return mem.make<data_chan>(std::make_shared<channel>(n > 1 ? static_cast<size_t>(n) : 1));
+}
+
+// send(ch, v): v once it is queued, null if ch is closed.
+inline ast* builtin_send(heap& mem, std::vector<ast*> const& as)
+{
+	auto ch = as.size() == 2 ? channel_of(as[0]) : nullptr;
+	return ch != nullptr && ch->send(mem.tasks, as[1]) ? as[1] : nullptr;
+}
+
+// recv(ch): the next value, null once ch is closed and drained.
+inline ast* builtin_recv(heap& mem, std::vector<ast*> const& as)
+{
+	auto ch = as.size() == 1 ? channel_of(as[0]) : nullptr;
+	return ch != nullptr ? ch->recv(mem, mem.tasks, false) : nullptr;
+}
+
+inline ast* builtin_close(heap&, std::vector<ast*> const& as)
+{
+	auto ch = as.size() == 1 ? channel_of(as[0]) : nullptr;
+	if (ch != nullptr) ch->close();
+	return nullptr;
+}
+
+// read(path): the contents of a file, null when it cannot be read. A task
+// leaves the read to the I/O threads and parks until it is done.
+inline ast* builtin_read(heap& mem, std::vector<ast*> const& as)
+{
+	if (as.size() != 1 || as[0] == nullptr || as[0]->type != ast::ast_type::data_str) return nullptr;
+	struct pending
+	{
+		std::mutex lock;
+		std::deque<waiter*> waiters;
+		std::string path;
+		std::string text;
+		bool ok{ false };
+		bool done{ false };
+
+		void load()
+		{
+			std::ifstream in(path, std::ios::binary);
+			ok = static_cast<bool>(in);
+			if (ok) text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		}
+	};
+	auto p = std::make_shared<pending>();
+	p->path = reinterpret_cast<data_str*>(as[0])->str();
+	auto t = task_scheduler::running();
+	if (t == nullptr)
+	{
+		p->load();
+	}
+	else
+	{
+		auto g = t->group;
+		{
+			std::lock_guard<std::mutex> guard(g->lock);
+			++g->reads;
+		}
+		task_scheduler::io().post([p, g]
+		{
+			pending loaded;
+			loaded.path = p->path;
+			loaded.load();
+			std::lock_guard<std::mutex> held(p->lock);
+			p->text = std::move(loaded.text);
+			p->ok = loaded.ok;
+			p->done = true;
+			for (auto w : std::exchange(p->waiters, {}))
+			{
+				task_scheduler::shared().resume(*w);
+			}
+			std::lock_guard<std::mutex> guard(g->lock);
+			--g->reads;
+			g->idle.notify_all();
+		});
+		std::unique_lock<std::mutex> held(p->lock);
+		wait_until(held, p->waiters, g, [&p] { return p->done; });
+	}
+	return p->ok ? mem.make<data_str>(std::move(p->text)) : nullptr;
+}
+
+struct snapshot_error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+// Image of the bindings of a module after its prelude ran: every value they
+// reach, the lambdas among them with their trees, and builtins by name. The
+// image holds no pointers or symbol ids: records refer to earlier records by
+// index and to symbols through a name table, so it can be mapped at any
+// address by any process. Loading is one pass over the mapping that rebuilds
+// the records in order; nothing is lexed, parsed or evaluated. The loaded
+// values belong to no heap and live as long as the snapshot.
+struct snapshot
+{
+	std::vector<std::pair<uint32_t, ast*>> globals;
+
+	snapshot() = default;
+	snapshot(snapshot const&) = delete;
+	snapshot& operator=(snapshot const&) = delete;
+
+	static void save(std::string const& path, std::vector<std::pair<uint32_t, ast*>> const& bindings)
+	{
+		image_writer w;
+		for (auto& [name, v] : bindings)
+		{
+			w.name(name);
+			w.emit(v);
+		}
+		header h;
+		h.objects = static_cast<uint32_t>(w.count);
+		h.names = static_cast<uint32_t>(w.names.size());
+		h.globals = static_cast<uint32_t>(bindings.size());
+		std::string image(sizeof(header), '\0');
+		image += w.records;
+		h.names_at = image.size();
+		for (auto id : w.names)
+		{
+			put_str(image, symbol_name(id));
+		}
+		h.globals_at = image.size();
+		for (auto& [name, v] : bindings)
+		{
+			put(image, w.name(name));
+			put(image, w.ref(v));
+		}
+		h.bytes = image.size();
+		std::memcpy(image.data(), &h, sizeof(h));
+
+		std::ofstream out(path, std::ios::binary);
+		out.write(image.data(), static_cast<std::streamsize>(image.size()));
+		if (!out) throw snapshot_error("cannot write snapshot " + path);
+	}
+
+	static std::unique_ptr<snapshot> load(std::string const& path)
+	{
+		mapped_file file(path);
+		auto s = std::make_unique<snapshot>();
+		s->read(file.data, file.size);
+		return s;
+	}
+
+private:
+	std::vector<std::unique_ptr<ast>> objects;
+
+	struct header
+	{
+		char magic[8]{ 'a', 'y', 'n', 's', 'n', 'a', 'p', '\0' };
+		uint32_t version{ 1 };
+		uint32_t byte_order{ 0x01020304 };
+		uint32_t objects{ 0 };
+		uint32_t names{ 0 };
+		uint32_t globals{ 0 };
+		uint32_t reserved{ 0 };
+		uint64_t names_at{ 0 };
+		uint64_t globals_at{ 0 };
+		uint64_t bytes{ 0 };
+	};
+
+	template <typename T>
+	static void put(std::string& out, T v)
+	{
+		out.append(reinterpret_cast<char const*>(&v), sizeof(v));
+	}
+	static void put_str(std::string& out, std::string const& s)
+	{
+		put(out, static_cast<uint32_t>(s.size()));
+		out += s;
+	}
+
+	// Records in dependency order: a record is written after everything it
+	// refers to, with refs as index + 1 and 0 for null.
+	struct image_writer
+	{
+		std::string records;
+		size_t count{ 0 };
+		std::vector<uint32_t> names;
+
+		uint32_t ref(ast* n) const
+		{
+			return n == nullptr ? 0 : index.at(n) + 1;
+		}
+		uint32_t name(uint32_t id)
+		{
+			auto [it, added] = name_index.insert({ id, static_cast<uint32_t>(names.size()) });
+			if (added) names.push_back(id);
+			return it->second;
+		}
+
+		void emit(ast* n)
+		{
+			if (n == nullptr) return;
+			if (auto it = index.find(n); it != std::end(index))
+			{
+				if (it->second == open) throw snapshot_error("cannot snapshot a cyclic value");
+				return;
+			}
+			if (n->type == ast::ast_type::data_chan) throw snapshot_error("cannot snapshot a channel");
+			index[n] = open;
+			if (n->type == ast::ast_type::func) reinterpret_cast<func*>(n)->body();
+			switch (n->type)
+			{
+			case ast::ast_type::data_obj:
+				for (auto v : reinterpret_cast<data_obj*>(n)->slots) emit(v);
+				break;
+			case ast::ast_type::data_vec:
+				for (auto v : reinterpret_cast<data_vec*>(n)->value) emit(v);
+				break;
+			default:
+				visit_children(n, [this](ast* c) { emit(c); });
+				break;
+			}
+			record(n);
+			index[n] = static_cast<uint32_t>(count++);
+		}
+
+	private:
+		static constexpr uint32_t open = static_cast<uint32_t>(-1);
+		std::unordered_map<ast*, uint32_t> index;
+		std::unordered_map<uint32_t, uint32_t> name_index;
+
+		void record(ast* n)
+		{
+			auto& out = records;
+			put(out, static_cast<uint8_t>(n->type));
+			switch (n->type)
+			{
+			case ast::ast_type::operation:
+				{
+					auto o = reinterpret_cast<operation*>(n);
+					put_str(out, o->op);
+					put(out, ref(o->l));
+					put(out, ref(o->r));
+				}
+				break;
+			case ast::ast_type::ite:
+				{
+					auto c = reinterpret_cast<ITE*>(n);
+					put(out, ref(c->p));
+					put(out, ref(c->t));
+					put(out, ref(c->e));
+				}
+				break;
+			case ast::ast_type::for_loop:
+				{
+					auto fr = reinterpret_cast<for_loop*>(n);
+					put(out, name(fr->sym_id));
+					put(out, static_cast<uint8_t>(fr->parallel));
+					put(out, ref(fr->rng));
+					put(out, ref(fr->b));
+				}
+				break;
+			case ast::ast_type::whl_loop:
+				put(out, ref(reinterpret_cast<whl_loop*>(n)->p));
+				put(out, ref(reinterpret_cast<whl_loop*>(n)->b));
+				break;
+			case ast::ast_type::body:
+				{
+					auto& stmts = reinterpret_cast<body_*>(n)->stmts;
+					put(out, static_cast<uint32_t>(stmts.size()));
+					for (auto stmt : stmts) put(out, ref(stmt));
+				}
+				break;
+			case ast::ast_type::func:
+				{
+					auto f = reinterpret_cast<func*>(n);
+					put(out, static_cast<uint32_t>(f->sym_ids.size()));
+					for (auto id : f->sym_ids) put(out, name(id));
+					put(out, ref(f->b));
+				}
+				break;
+			case ast::ast_type::call:
+				{
+					auto c = reinterpret_cast<call_*>(n);
+					put(out, ref(c->src));
+					put(out, static_cast<uint32_t>(c->as.size()));
+					for (auto a : c->as) put(out, ref(a));
+				}
+				break;
+			case ast::ast_type::assign:
+				put(out, name(reinterpret_cast<assign*>(n)->sym_id));
+				put(out, ref(reinterpret_cast<assign*>(n)->v));
+				break;
+			case ast::ast_type::symbol:
+				put(out, name(reinterpret_cast<sym*>(n)->sym_id));
+				break;
+			case ast::ast_type::number:
+				put_str(out, reinterpret_cast<num*>(n)->n);
+				break;
+			case ast::ast_type::string:
+				put_str(out, reinterpret_cast<str*>(n)->s);
+				break;
+			case ast::ast_type::native:
+				put(out, name(symbol_id(reinterpret_cast<native*>(n)->name)));
+				break;
+			case ast::ast_type::data_num:
+				put(out, reinterpret_cast<data_num*>(n)->value);
+				break;
+			case ast::ast_type::data_str:
+				put_str(out, reinterpret_cast<data_str*>(n)->str());
+				break;
+			case ast::ast_type::data_obj:
+				{
+					auto o = reinterpret_cast<data_obj*>(n);
+					put(out, static_cast<uint32_t>(o->slots.size()));
+					for (size_t i = 0; i < o->slots.size(); ++i)
+					{
+						put_str(out, o->shp->keys[i]);
+						put(out, ref(o->slots[i]));
+					}
+				}
+				break;
+			case ast::ast_type::data_vec:
+				{
+					auto& values = reinterpret_cast<data_vec*>(n)->value;
+					put(out, static_cast<uint32_t>(values.size()));
+					for (auto v : values) put(out, ref(v));
+				}
+				break;
+			case ast::ast_type::data_rng:
+				{
+					auto r = reinterpret_cast<data_rng*>(n);
+					put(out, r->start);
+					put(out, r->stop);
+					put(out, r->step);
+				}
+				break;
+			case ast::ast_type::data_arr:
+				{
+					auto& values = reinterpret_cast<data_arr*>(n)->value;
+					put(out, static_cast<uint64_t>(values.size()));
+					out.append(reinterpret_cast<char const*>(values.data()), values.size() * sizeof(double));
+				}
+				break;
+			case ast::ast_type::data_chan:
+				// refused by emit
+				break;
+			}
+		}
+	};
+
+	// Bounds-checked cursor over the image.
+	struct image_reader
+	{
+		char const* at;
+		char const* end;
+
+		template <typename T>
+		T get()
+		{
+			T v;
+			need(sizeof(v));
+			std::memcpy(&v, at, sizeof(v));
+			at += sizeof(v);
+			return v;
+		}
+		std::string str()
+		{
+			auto const n = get<uint32_t>();
+			need(n);
+			std::string s(at, n);
+			at += n;
+			return s;
+		}
+		// A length that prefixes that many 4-byte fields.
+		uint32_t count()
+		{
+			auto const n = get<uint32_t>();
+			need(static_cast<size_t>(n) * sizeof(uint32_t));
+			return n;
+		}
+		void need(size_t n) const
+		{
+			if (static_cast<size_t>(end - at) < n) throw snapshot_error("snapshot is truncated");
+		}
+	};
+
+	// The file's bytes, mapped where the platform allows it.
+	struct mapped_file
+	{
+		char const* data{ nullptr };
+		size_t size{ 0 };
+
+		explicit mapped_file(std::string const& path)
+		{
+#if defined(AYNANA_MMAP)
+			auto const fd = ::open(path.c_str(), O_RDONLY);
+			struct stat st{};
+			if (fd < 0 || ::fstat(fd, &st) != 0)
+			{
+				if (fd >= 0) ::close(fd);
+				throw snapshot_error("cannot open snapshot " + path);
+			}
+			size = static_cast<size_t>(st.st_size);
+			auto p = size == 0 ? MAP_FAILED : ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (p == MAP_FAILED) throw snapshot_error("cannot map snapshot " + path);
+			data = static_cast<char const*>(p);
+#else
+			std::ifstream in(path, std::ios::binary);
+			if (!in) throw snapshot_error("cannot open snapshot " + path);
+			copy.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			data = copy.data();
+			size = copy.size();
+#endif
+		}
+		mapped_file(mapped_file const&) = delete;
+		mapped_file& operator=(mapped_file const&) = delete;
+		~mapped_file()
+		{
+#if defined(AYNANA_MMAP)
+			::munmap(const_cast<char*>(data), size);
+#endif
+		}
+
+	private:
+		std::string copy;
+	};
+
+	void read(char const* data, size_t size)
+	{
+		header h;
+		header const expected;
+		if (size < sizeof(h)) throw snapshot_error("not a snapshot");
+		std::memcpy(&h, data, sizeof(h));
+		if (std::memcmp(h.magic, expected.magic, sizeof(h.magic)) != 0 || h.byte_order != expected.byte_order) throw snapshot_error("not a snapshot");
+		if (h.version != expected.version) throw snapshot_error("snapshot version " + std::to_string(h.version) + " is not supported");
+		if (h.bytes != size || h.names_at < sizeof(h) || h.names_at > h.globals_at || h.globals_at > size) throw snapshot_error("snapshot is truncated");
+		if (h.objects > h.names_at - sizeof(h) || h.names > (h.globals_at - h.names_at) / sizeof(uint32_t)
+			|| h.globals > (size - h.globals_at) / (2 * sizeof(uint32_t)))
+		{
+			throw snapshot_error("snapshot is corrupt");
+		}
+
+		image_reader names_in{ data + h.names_at, data + h.globals_at };
+		std::vector<uint32_t> ids(h.names);
+		for (auto& id : ids)
+		{
+			id = symbol_id(names_in.str());
+		}
+		image_reader in{ data + sizeof(h), data + h.names_at };
+		auto name = [&ids](image_reader& r)
+		{
+			auto const i = r.get<uint32_t>();
+			if (i >= ids.size()) throw snapshot_error("snapshot refers to a missing name");
+			return ids[i];
+		};
+		std::vector<ast*> table;
+		// required: a child the parser never leaves null
+		auto ref = [&table](image_reader& r, bool required = false) -> ast*
+		{
+			auto const i = r.get<uint32_t>();
+			if (i > table.size() || (required && i == 0)) throw snapshot_error("snapshot refers to a missing record");
+			return i == 0 ? nullptr : table[i - 1];
+		};
+		auto refs = [&ref](image_reader& r, bool required = false)
+		{
+			std::vector<ast*> res(r.count());
+			for (auto& v : res) v = ref(r, required);
+			return res;
+		};
+		table.reserve(h.objects);
+		for (uint32_t k = 0; k < h.objects; ++k)
+		{
+			auto n = record(in, name, ref, refs);
+			table.push_back(n);
+			// builtins are shared, not owned
+			if (n->type != ast::ast_type::native) objects.emplace_back(n);
+		}
+		image_reader globals_in{ data + h.globals_at, data + size };
+		for (uint32_t k = 0; k < h.globals; ++k)
+		{
+			auto const id = name(globals_in);
+			globals.push_back({ id, ref(globals_in) });
+		}
+	}
+
+	// Every field is read before the node is made, so a bad image leaks
+	// nothing.
+	template <typename Name, typename Ref, typename Refs>
+	static ast* record(image_reader& in, Name& name, Ref& ref, Refs& refs)
+	{
+		auto const tag = in.get<uint8_t>();
+		if (tag > static_cast<uint8_t>(ast::ast_type::data_arr)) throw snapshot_error("snapshot has an unknown record");
+		switch (static_cast<ast::ast_type>(tag))
+		{
+		case ast::ast_type::operation:
+			{
+				auto op = in.str();
+				auto l = ref(in, true);
+				auto r = ref(in, true);
+				return new operation(op, l, r);
+			}
+		case ast::ast_type::ite:
+			{
+				auto p = ref(in, true);
+				auto t = ref(in, true);
+				auto e = ref(in);
+				return new ITE(p, t, e);
+			}
+		case ast::ast_type::for_loop:
+			{
+				auto const id = name(in);
+				bool const parallel = in.get<uint8_t>() != 0;
+				auto rng = ref(in, true);
+				auto b = ref(in, true);
+				auto fr = new for_loop(symbol_name(id), id, rng, b);
+				fr->parallel = parallel;
+				return fr;
+			}
+		case ast::ast_type::whl_loop:
+			{
+				auto p = ref(in, true);
+				auto b = ref(in, true);
+				return new whl_loop(p, b);
+			}
+		case ast::ast_type::body:
+			{
+				auto stmts = refs(in, true);
+				auto b = new body_();
+				b->stmts = std::move(stmts);
+				return b;
+			}
+		case ast::ast_type::func:
+			{
+				std::vector<uint32_t> ids(in.count());
+				for (auto& id : ids) id = name(in);
+				auto b = ref(in);
+				auto f = new func(b);
+				for (auto id : ids)
+				{
+					f->as.push_back(symbol_name(id));
+				}
+				f->sym_ids = std::move(ids);
+				return f;
+			}
+		case ast::ast_type::call:
+			{
+				auto src = ref(in, true);
+				auto as = refs(in, true);
+				auto c = new call_();
+				c->src = src;
+				c->as = std::move(as);
+				return c;
+			}
+		case ast::ast_type::assign:
+			{
+				auto const id = name(in);
+				auto v = ref(in, true);
+				return new assign(symbol_name(id), id, v);
+			}
+		case ast::ast_type::symbol:
+			{
+				auto const id = name(in);
+				return new sym(symbol_name(id), id);
+			}
+		case ast::ast_type::number:
+			return new num(in.str());
+		case ast::ast_type::string:
+			return new str(in.str());
+		case ast::ast_type::native:
+			{
+				auto b = find_builtin(name(in));
+				if (b == nullptr) throw snapshot_error("snapshot refers to a missing builtin");
+				return b;
+			}
+		case ast::ast_type::data_num:
+			return new data_num(in.get<double>());
+		case ast::ast_type::data_str:
+			return new data_str(in.str());
+		case ast::ast_type::data_obj:
+			{
+				auto shp = shape::root();
+				std::vector<ast*> slots(in.count());
+				for (auto& v : slots)
+				{
+					shp = shp->with_key(in.str());
+					v = ref(in);
+				}
+				return new data_obj(shp, slots);
+			}
+		case ast::ast_type::data_vec:
+			{
+				return new data_vec(refs(in));
+			}
+		case ast::ast_type::data_rng:
+			{
+				auto const start = in.get<double>();
+				auto const stop = in.get<double>();
+				auto const step = in.get<double>();
+				return new data_rng(start, stop, step);
+			}
+		case ast::ast_type::data_arr:
+			{
+				auto const n = in.get<uint64_t>();
+				if (n > static_cast<uint64_t>(in.end - in.at) / sizeof(double)) throw snapshot_error("snapshot is truncated");
+				auto a = new data_arr(static_cast<size_t>(n));
+				std::memcpy(a->value.data(), in.at, a->value.size() * sizeof(double));
+				in.at += a->value.size() * sizeof(double);
+				return a;
+			}
+		case ast::ast_type::data_chan:
+			break;
+		}
+		return nullptr;
+	}
+};
+
+struct scope
+{
+	// Tallied size of one binding: the map node plus its bucket.
+	static constexpr size_t entry_bytes = sizeof(std::pair<uint32_t const, ast*>) + 2 * sizeof(void*);
+
+	scope() = default;
+	
+	scope(scope const& s) : scp(s.scp)
+	{
+	}
+	scope clone()
+	{
+		return scope(*this);
+	}
+	// True when the key was not bound yet.
+	bool set(uint32_t key, ast* value)
+	{
+		return scp.insert_or_assign(key, value).second;
+	}
+	ast* get(uint32_t key)
+	{
+		return scp[key];
+	}
+	size_t size() const
+	{
+		return scp.size();
+	}
+
+	bool has(uint32_t key)
+	{
+		return scp.count(key);
+	}
+	void merge(scope const& s)
+	{
+		for (auto& [key, val] : s.scp)
+		{
+			scp[key] = val;
+		}
+	}
+
+	void trace(std::vector<ast*>& gray) const
+	{
+		for (auto& [key, val] : scp)
+		{
+			gray.push_back(val);
+		}
+	}
+
+	// The bindings ordered by key.
+	std::vector<std::pair<uint32_t, ast*>> entries() const
+	{
+		std::vector<std::pair<uint32_t, ast*>> res(std::begin(scp), std::end(scp));
+		std::sort(std::begin(res), std::end(res), [](auto const& a, auto const& b) { return a.first < b.first; });
+		return res;
+	}
+
+private:
+	std::unordered_map<uint32_t, ast*> scp;
+};
+
+struct block_context
+{
+	std::string module_name;
+	scope block_scope{};
+	bool return_called{ false };
+	bool break_called{ false };
+	bool continue_called{ false };
+	ast* return_object{ nullptr };
+};
+
+struct evaluator
+{
+private:
+	std::unique_ptr<heap> owned;
+
+public:
+	heap& mem;
+
+	evaluator() : evaluator(std::make_unique<heap>())
+	{
+	}
+	explicit evaluator(heap& m) : mem(m)
+	{
+		watch_roots();
+	}
+	evaluator(evaluator const&) = delete;
+	evaluator& operator=(evaluator const&) = delete;
+
+	~evaluator()
+	{
+		while (!ctx.empty())
+		{
+			pop_context();
+		}
+		mem.scan_roots = nullptr;
+		mem.launch = nullptr;
+	}
+
+	void push_context(block_context c = {})
+	{
+		mem.enter_scope(sizeof(block_context));
+		ctx.push_back(std::move(c));
+	}
+	void pop_context()
+	{
+		mem.leave_scope(sizeof(block_context) + ctx.back().block_scope.size() * scope::entry_bytes);
+		ctx.pop_back();
+	}
+
+	void run_func(func* f, const std::vector<ast*>& as)
+	{
+		if (ast* res = nullptr; run_kernel(f, mem, as.data(), as.size(), res))
+		{
+			ctx.back().return_object = res;
+			return;
+		}
+		note_arguments(f, as.data(), as.size());
+		push_context();
+		
+		for (size_t i = 0; i < as.size() && i < f->as.size(); ++i)
+		{
+			set(f->sym_ids[i], as[i]);
+		}
+		if (f->body() != nullptr)
+		{
+			eval(f->b);
+		}
+		auto const ret = ctx.back().return_object;
+		pop_context();
+		ctx.back().return_object = ret;
+		note_result(f, ret);
+	}
+
+	void eval(ast* node)
+	{
+		switch (node->type)
+		{
+		case ast::ast_type::assign:
+			if (!ctx.empty())
+			{
+				auto a = reinterpret_cast<assign*>(node);
+				eval(a->v);
+				set(a->sym_id, ctx.back().return_object);
+				ctx.back().return_object = nullptr;
+			}
+			break;
+		case ast::ast_type::body:
+			{
+				push_context();
 				auto& stmts = reinterpret_cast<body_*>(node)->stmts;
 				auto const sz = stmts.size();
+				if (sz == 0)
+				{
+					pop_context();
+					ctx.back().return_object = nullptr;
+				}
 				for (size_t i = 0; i < sz; ++i)
 				{
-					eval(stmts[i]);
-					auto& ctx_back = ctx.back();
-					if (ctx_back.break_called)
-					{
-						break;
-					}
-					if (ctx_back.return_called || i == sz - 1)
-					{
-						auto rt = ctx_back.return_object;
-						ctx.pop_back();
-						ctx.back().return_object = rt;
-						break;
-					}
-					delete ctx_back.return_object;
-					ctx_back.return_object = nullptr;
+					eval(stmts[i]);
+					auto& ctx_back = ctx.back();
+					if (ctx_back.break_called)
+					{
+						break;
+					}
+					if (ctx_back.return_called || i == sz - 1)
+					{
+						auto rt = ctx_back.return_object;
+						pop_context();
+						ctx.back().return_object = rt;
+						break;
+					}
+					ctx_back.return_object = nullptr;
+					mem.safepoint();
+				}
+			}
+			break;
+		case ast::ast_type::call:
+			{
+				auto expr = reinterpret_cast<call_*>(node);
+				eval(expr->src);
+				auto f = ctx.back().return_object;
+				auto const roots = mem.roots.size();
+				for (auto a : expr->as)
+				{
+					eval(a);
+					mem.roots.push_back(ctx.back().return_object);
+				}
+				std::vector<ast*> as(std::begin(mem.roots) + roots, std::end(mem.roots));
+				mem.roots.resize(roots);
+				if (f != nullptr && f->type == ast::ast_type::native)
+				{
+					ctx.back().return_object = reinterpret_cast<native*>(f)->fn(mem, as);
+				}
+				else if (f != nullptr && f->type == ast::ast_type::func)
+				{
+					run_func(reinterpret_cast<func*>(f), as);
+				}
+				else
+				{
+					ctx.back().return_object = nullptr;
+				}
+			}
+			break;
+		case ast::ast_type::for_loop:
+			{
+				auto fr = reinterpret_cast<for_loop*>(node);
+				eval(fr->rng);
+				auto rng = ctx.back().return_object;
+				ctx.back().return_object = nullptr;
+				if (fr->parallel)
+				{
+					ctx.back().return_object = eval_parallel_for(fr, rng);
+					break;
+				}
+				mem.roots.push_back(rng);
+				
+				value_iterator it(rng);
+				for (ast* r = nullptr; it.next(mem, r);)
+				{
+					set(fr->sym_id, r);
+					eval(fr->b);
+					if (auto& back = ctx.back(); back.break_called || back.return_called)
+					{
+					}
+					ctx.back().return_object = nullptr;
+					mem.safepoint();
+				}
+				mem.roots.pop_back();
+			}
+			break;
+		case ast::ast_type::whl_loop:
+			{
+			}
+			break;
+		case ast::ast_type::func:
+			{
+				ctx.back().return_object = node;
+			}
+			break;
+		case ast::ast_type::ite:
+			{
+			}
+			break;
+		case ast::ast_type::number:
+			{
+				ctx.back().return_object = mem.make<data_num>(atof(reinterpret_cast<num*>(node)->n.c_str()));
+			}
+			break;
+		case ast::ast_type::string:
+			{
+				ctx.back().return_object = reinterpret_cast<str*>(node)->value();
+			}
+			break;
+		case ast::ast_type::symbol:
+			{
+				ctx.back().return_object = get(reinterpret_cast<sym*>(node)->sym_id);
+			}
+			break;
+		case ast::ast_type::operation:
+			{
+				auto o = reinterpret_cast<operation*>(node);
+				eval(o->l);
+				auto l = ctx.back().return_object;
+				if (o->op == "." && o->r->type == ast::ast_type::symbol)
+				{
+					ctx.back().return_object = l != nullptr && l->type == ast::ast_type::data_obj
+						? load_property(o->ic, reinterpret_cast<data_obj*>(l), reinterpret_cast<sym*>(o->r)->s)
+						: nullptr;
+					break;
+				}
+				mem.roots.push_back(l);
+				eval(o->r);
+				auto r = ctx.back().return_object;
+				mem.roots.pop_back();
+				ctx.back().return_object = apply_operation(mem, o->op, l, r);
+			}
+			break;
+		case ast::ast_type::data_num:
+		case ast::ast_type::data_obj:
+		case ast::ast_type::data_str:
+		case ast::ast_type::data_vec:
+			ctx.back().return_object = node;
+			break;
+		default:
+			break;
+		}
+	}
+
+	std::vector<block_context> ctx;
+
+	void add_module(std::string const& module_name)
+	{
+		push_context(block_context{ module_name });
+	}
+
+	// Runs the statements of a script in the module context instead of a
+	// block of their own, so its bindings stay for a snapshot.
+	void eval_module(ast* root)
+	{
+		if (ctx.empty()) add_module("main");
+		if (root->type != ast::ast_type::body)
+		{
+			eval(root);
+			return;
+		}
+		auto& stmts = reinterpret_cast<body_*>(root)->stmts;
+		for (size_t i = 0; i < stmts.size(); ++i)
+		{
+			if (i != 0)
+			{
+				ctx.back().return_object = nullptr;
+				mem.safepoint();
+			}
+			eval(stmts[i]);
+		}
+	}
+
+	// Binds the globals of a snapshot in the module context.
+	void restore(snapshot const& s)
+	{
+		for (auto& [name, v] : s.globals)
+		{
+			set(name, v);
+		}
+	}
+
+private:
+	
+	ast* get(uint32_t key)
+	{
+		if (ctx.empty()) add_module("main");
+		ast* res = nullptr;
+		for (size_t i = ctx.size() - 1; ; --i)
+		{
+			if (ctx[i].block_scope.has(key))
+			{
+				res = ctx[i].block_scope.get(key);
+				break;
+			}
+			if (i == 0)
+			{
+				res = find_builtin(key);
+				break;
+			}
+		}
+		return res;
+	}
+	void set(uint32_t key, ast* value)
+	{
+		if (ctx.empty()) add_module("main");
+		if (ctx.back().block_scope.set(key, value)) mem.enter_scope(scope::entry_bytes, 0);
+	}
+
+	explicit evaluator(std::unique_ptr<heap> m) : owned(std::move(m)), mem(*owned)
+	{
+		watch_roots();
+	}
+	void watch_roots()
+	{
+		mem.scan_roots = [this](std::vector<ast*>& gray)
+		{
+			for (auto& c : ctx)
+			{
+				c.block_scope.trace(gray);
+				gray.push_back(c.return_object);
+			}
+		};
+		// A task runs in an evaluator of its own over the lambdas and
+		// builtins bound here.
+		mem.launch = [this](func* f) -> heap::task_body
+		{
+			std::vector<std::pair<uint32_t, ast*>> env;
+			for (auto& c : ctx)
+			{
+				for (auto& [key, v] : c.block_scope.entries())
+				{
+					env.emplace_back(key, is_data(v) ? nullptr : v);
 				}
 			}
-			break;
-		case ast::ast_type::call:
+			return [env = std::move(env), f](heap& tm, std::vector<ast*> const& as)
 			{
-				auto expr = reinterpret_cast<call_*>(node);
-				eval(expr->src);
-				auto f = reinterpret_cast<func*>(ctx.back().return_object);
-				std::vector<ast*> as;
-				for (auto a : expr->as)
+				evaluator w(tm);
+				w.add_module("task");
+				for (auto& [key, v] : env)
 				{
-					eval(a);
-					as.push_back(ctx.back().return_object);
+					w.set(key, v);
+				}
+				w.run_func(f, as);
+				return w.ctx.back().return_object;
+			};
+		};
+	}
+
+	// `par for`: every iteration runs in a worker evaluator over a copy of
+	// the visible bindings, and the body values are collected in order.
+	ast* eval_parallel_for(for_loop* fr, ast* rng)
+	{
+		value_iterator it(rng);
+		auto res = parallel_map(mem, it.n, [&](heap& wmem, size_t lo, size_t hi, std::vector<ast*>& out)
+		{
+			evaluator w(wmem);
+			w.add_module("par");
+			for (auto& c : ctx)
+			{
+				w.ctx.back().block_scope.merge(c.block_scope);
+			}
+			wmem.enter_scope(w.ctx.back().block_scope.size() * scope::entry_bytes, 0);
+			for (size_t k = lo; k < hi; ++k)
+			{
+				w.set(fr->sym_id, it.at(wmem, k));
+				w.eval(fr->b);
+				out.push_back(w.ctx.back().return_object);
+				w.ctx.back().return_object = nullptr;
+				wmem.safepoint();
+			}
+		});
+		if (it.n != 0)
+		{
+			mem.roots.push_back(res);
+			set(fr->sym_id, it.at(mem, it.n - 1));
+			mem.roots.pop_back();
+		}
+		return res;
+	}
+};
+
+// One bit per slot of a frame. The first 64 are kept inline, so a call
+// with few slots does not allocate for them.
+struct slot_bits
+{
+	uint64_t low{ 0 };
+	std::vector<uint64_t> high;
+
+	slot_bits() = default;
+	// The first `set` of `slots` bits are set.
+	slot_bits(size_t slots, size_t set) : high(slots > 64 ? (slots - 1) / 64 : 0)
+	{
+		update(0, set, true);
+	}
+
+	bool test(size_t i) const
+	{
+		if (i < 64) return (low >> i & 1) != 0;
+		return i / 64 - 1 < high.size() && (high[i / 64 - 1] >> i % 64 & 1) != 0;
+	}
+	void set(size_t i)
+	{
+		word(i) |= uint64_t{ 1 } << i % 64;
+	}
+	// Sets or clears the bits of [first, last).
+	void update(size_t first, size_t last, bool on)
+	{
+		for (size_t i = first; i < last;)
+		{
+			auto const end = std::min(last, (i / 64 + 1) * 64);
+			auto const n = end - i;
+			auto const mask = (n == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << n) - 1) << i % 64;
+			auto& w = word(i);
+			w = on ? w | mask : w & ~mask;
+			i = end;
+		}
+	}
+
+private:
+	uint64_t& word(size_t i)
+	{
+		if (i < 64) return low;
+		if (i / 64 > high.size()) high.resize(i / 64);
+		return high[i / 64 - 1];
+	}
+};
+
+// The slots of one call. caller and names let a lambda read the locals of
+// the calls it runs under, as the tree-walker's scope chain does.
+struct frame
+{
+	std::vector<ast*> slots;
+	frame* globals{ nullptr };
+	heap* mem{ nullptr };
+	frame* caller{ nullptr };
+	std::vector<uint32_t> const* names{ nullptr };
+	// slots that hold a binding, even a null one: the parameters the call
+	// gave and the locals assigned so far
+	slot_bits bound{};
+};
+
+struct closure_compiler
+{
+	using code = std::function<ast*(frame&)>;
+
+	struct proc
+	{
+		size_t params{ 0 };
+		size_t slots{ 0 };
+		// the name bound in each slot
+		std::vector<uint32_t> names;
+		code body;
+		// false while the body of a pre-parsed lambda waits for its first call
+		std::atomic<bool> ready{ true };
+	};
+
+	closure_compiler() = default;
+	closure_compiler(closure_compiler const&) = delete;
+	closure_compiler& operator=(closure_compiler const&) = delete;
+
+	// preset: globals bound before the program starts, such as those of a
+	// snapshot; the lambdas they reach are compiled too.
+	proc& compile_program(ast* root, std::vector<std::pair<uint32_t, ast*>> const& preset = {})
+	{
+		fn_scope top;
+		top.is_module = true;
+		module = &top;
+		collect_locals(root);
+		for (auto& [name, v] : preset)
+		{
+			collect_locals(v);
+		}
+		for (auto& [name, v] : preset)
+		{
+			presets.push_back({ global_slot(name), v });
+			compile_values(v);
+		}
+		program.body = compile(root, top);
+		program.slots = top.slots;
+		program.names = std::move(top.names);
+		module = nullptr;
+		launcher = [this](frame const& g, func* fn) { return task_body(g, fn); };
+		return program;
+	}
+
+	// Runs the compiled program with inputs preloaded into global slots.
+	// Does not modify the compiler, so one instance may run on many threads.
+	ast* run(heap& mem, std::vector<std::pair<size_t, ast*>> const& inputs = {}) const
+	{
+		frame globals{ std::vector<ast*>(program.slots, nullptr), nullptr, &mem, nullptr, &program.names };
+		globals.globals = &globals;
+		for (auto& [slot, b] : presets)
+		{
+			globals.slots[slot] = b;
+		}
+		for (auto& [slot, v] : inputs)
+		{
+			globals.slots[slot] = v;
+		}
+		mem.enter_scope(frame_bytes(globals));
+		mem.frames.push_back(&globals.slots);
+		mem.launch = [this, &globals](func* fn) { return launcher(globals, fn); };
+		auto res = program.body(globals);
+		mem.launch = nullptr;
+		mem.frames.pop_back();
+		mem.leave_scope(frame_bytes(globals));
+		return res;
+	}
+
+	// Global slot of a name, npos when the program never refers to it.
+	size_t global_slot_of(uint32_t name) const
+	{
+		auto it = globals.find(name);
+		return it == std::end(globals) ? npos : it->second;
+	}
+
+	static constexpr size_t npos = static_cast<size_t>(-1);
+
+private:
+	struct slot_ref
+	{
+		bool global;
+		size_t index;
+	};
+
+	struct fn_scope
+	{
+		bool is_module{ false };
+		std::vector<std::map<uint32_t, size_t>> blocks;
+		size_t slots{ 0 };
+		std::vector<uint32_t> names;
+	};
+
+	struct call_site
+	{
+		std::atomic<std::pair<func* const, proc>*> entry{ nullptr };
+	};
+
+	fn_scope* module{ nullptr };
+	std::map<uint32_t, size_t> globals;
+	std::unordered_map<func*, proc> procs;
+	std::shared_mutex procs_lock;
+	std::vector<std::unique_ptr<ast>> constants;
+	std::vector<std::pair<size_t, ast*>> presets;
+	proc program;
+	std::function<heap::task_body(frame const&, func*)> launcher;
+	// Names some lambda binds for itself. A lambda that reads one of these
+	// without binding it looks through its callers first.
+	std::unordered_set<uint32_t> locals;
+	// the name of a slot no lambda binds by name, such as a global's
+	static constexpr uint32_t unnamed = ~uint32_t{ 0 };
+
+	static ast*& at(frame& f, slot_ref r)
+	{
+		return r.global ? f.globals->slots[r.index] : f.slots[r.index];
+	}
+
+	size_t global_slot(uint32_t name)
+	{
+		if (auto it = globals.find(name); it != std::end(globals))
+		{
+			return it->second;
+		}
+		auto const slot = globals[name] = module->slots++;
+		if (auto b = find_builtin(name); b != nullptr)
+		{
+			presets.push_back({ slot, b });
+		}
+		return slot;
+	}
+
+	void declare(fn_scope& fs, uint32_t name)
+	{
+		auto& names = fs.blocks.back();
+		if (names.count(name)) return;
+		if (fs.is_module && fs.blocks.size() == 1)
+		{
+			names[name] = global_slot(name);
+			return;
+		}
+		auto const slot = names[name] = fs.slots++;
+		if (fs.names.size() <= slot) fs.names.resize(slot + 1, unnamed);
+		fs.names[slot] = name;
+	}
+
+	// Everything a pre-parsed body names may be one of its locals.
+	void collect_locals(ast* n, bool in_func = false)
+	{
+		if (n == nullptr) return;
+		switch (n->type)
+		{
+		case ast::ast_type::func:
+			{
+				auto f = reinterpret_cast<func*>(n);
+				locals.insert(std::begin(f->sym_ids), std::end(f->sym_ids));
+				if (f->lazy != nullptr && !f->lazy->parsed.load(std::memory_order_acquire))
+				{
+					locals.insert(std::begin(f->lazy->names), std::end(f->lazy->names));
 				}
-				run_func(f, as);
+				in_func = true;
 			}
 			break;
+		case ast::ast_type::assign:
+			if (in_func) locals.insert(reinterpret_cast<assign*>(n)->sym_id);
+			break;
 		case ast::ast_type::for_loop:
+			if (in_func) locals.insert(reinterpret_cast<for_loop*>(n)->sym_id);
+			break;
+		default:
+			break;
+		}
+		visit_children(n, [this, in_func](ast* c) { collect_locals(c, in_func); });
+	}
+
+	static bool is_bound(frame const& f, size_t i)
+	{
+		return f.slots[i] != nullptr || f.bound.test(i);
+	}
+	static void bind(frame& f, slot_ref r, ast* v)
+	{
+		at(f, r) = v;
+		if (!r.global) f.bound.set(r.index);
+	}
+
+	// The nearest caller's binding of name.
+	static bool caller_binding(frame const& f, uint32_t name, ast*& res)
+	{
+		for (auto c = f.caller; c != nullptr; c = c->caller)
+		{
+			if (c->names == nullptr) continue;
+			// inner blocks take later slots
+			auto& names = *c->names;
+			for (size_t i = std::min(names.size(), c->slots.size()); i-- > 0;)
 			{
-				auto fr = reinterpret_cast<for_loop*>(node);
-				eval(fr->rng);
-				auto rng = reinterpret_cast<data_vec*>(ctx.back().return_object);
-				ctx.back().return_object = nullptr;
-				
-				for (auto r : rng->value)
+				if (names[i] != name || !is_bound(*c, i)) continue;
+				res = c->slots[i];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	slot_ref resolve_local(fn_scope& fs, uint32_t name)
+	{
+		return { fs.is_module, fs.blocks.back().at(name) };
+	}
+
+	std::vector<slot_ref> resolve(fn_scope& fs, uint32_t name)
+	{
+		std::vector<slot_ref> chain;
+		for (size_t i = fs.blocks.size(); i-- > 0;)
+		{
+			if (auto it = fs.blocks[i].find(name); it != std::end(fs.blocks[i]))
+			{
+				chain.push_back({ fs.is_module, it->second });
+			}
+		}
+		if (!fs.is_module || chain.empty())
+		{
+			chain.push_back({ true, global_slot(name) });
+		}
+		return chain;
+	}
+
+	template <typename T, typename... Args>
+	ast* constant(Args&&... args)
+	{
+		constants.push_back(std::make_unique<T>(std::forward<Args>(args)...));
+		return constants.back().get();
+	}
+
+	proc& compile_func(func* f)
+	{
+		if (auto it = procs.find(f); it != std::end(procs))
+		{
+			return it->second;
+		}
+		auto& p = procs[f];
+		p.params = f->as.size();
+		if (f->lazy != nullptr && !f->lazy->parsed.load(std::memory_order_acquire))
+		{
+			// Every global the body may name gets its slot now, while the
+			// module frame can still grow; the names of nested stubs are
+			// among these too.
+			if (module != nullptr)
+			{
+				for (auto name : f->lazy->names)
 				{
-					ctx.back().block_scope.set(fr->i, r);
-					eval(fr->b);
-					if (auto& back = ctx.back(); back.break_called || back.return_called)
-					{
-					}
+					global_slot(name);
 				}
 			}
-			break;
-		case ast::ast_type::whl_loop:
+			p.ready.store(false, std::memory_order_relaxed);
+			return p;
+		}
+		compile_body(f, p);
+		return p;
+	}
+
+	void compile_values(ast* v)
+	{
+		std::vector<ast*> pending{ v };
+		std::unordered_set<ast*> seen;
+		while (!pending.empty())
+		{
+			auto n = pending.back();
+			pending.pop_back();
+			if (n == nullptr || !seen.insert(n).second) continue;
+			if (n->type == ast::ast_type::func) compile_func(reinterpret_cast<func*>(n));
+			if (n->type == ast::ast_type::data_obj || n->type == ast::ast_type::data_vec) reinterpret_cast<gc_object*>(n)->trace(pending);
+		}
+	}
+
+	// A task calls its lambda on a copy of the module frame in which only
+	// the lambdas and builtins stay.
+	heap::task_body task_body(frame const& globals, func* fn)
+	{
+		std::vector<ast*> slots(globals.slots);
+		for (auto& v : slots)
+		{
+			if (is_data(v)) v = nullptr;
+		}
+		return [this, slots = std::move(slots), fn](heap& mem, std::vector<ast*> const& as)
+		{
+			frame g{ slots, nullptr, &mem, nullptr, &program.names };
+			g.globals = &g;
+			mem.launch = [this, &g](func* f) { return task_body(g, f); };
+			mem.enter_scope(frame_bytes(g));
+			mem.frames.push_back(&g.slots);
+			auto res = invoke(fn, g, as);
+			mem.frames.pop_back();
+			mem.leave_scope(frame_bytes(g));
+			mem.launch = nullptr;
+			return res;
+		};
+	}
+
+	ast* invoke(func* fn, frame& f, std::vector<ast*> const& as)
+	{
+		proc* p = nullptr;
+		{
+			std::shared_lock<std::shared_mutex> lock(procs_lock);
+			auto it = procs.find(fn);
+			if (it == std::end(procs)) return nullptr;
+			p = &it->second;
+		}
+		if (!p->ready.load(std::memory_order_acquire)) compile_lazy(fn, *p);
+		if (ast* res = nullptr; run_kernel(fn, *f.mem, as.data(), as.size(), res)) return res;
+		auto const slots = std::max(p->slots, as.size());
+		frame callee_frame{ std::vector<ast*>(slots, nullptr), f.globals, f.mem, &f, &p->names, slot_bits(slots, std::min(p->params, as.size())) };
+		std::copy(std::begin(as), std::begin(as) + std::min(p->params, as.size()), std::begin(callee_frame.slots));
+		f.mem->enter_scope(frame_bytes(callee_frame));
+		f.mem->frames.push_back(&callee_frame.slots);
+		auto res = p->body(callee_frame);
+		f.mem->frames.pop_back();
+		f.mem->leave_scope(frame_bytes(callee_frame));
+		return res;
+	}
+
+	void compile_body(func* f, proc& p)
+	{
+		fn_scope fs;
+		auto& params = fs.blocks.emplace_back();
+		for (auto a : f->sym_ids)
+		{
+			if (params.count(a)) continue;
+			params[a] = fs.slots++;
+			fs.names.resize(fs.slots, unnamed);
+			fs.names.back() = a;
+		}
+		p.body = f->body() == nullptr ? code{ [](frame&) -> ast* { return nullptr; } } : compile(f->b, fs);
+		p.slots = std::max(fs.slots, p.params);
+		p.names = std::move(fs.names);
+		p.names.resize(p.slots, unnamed);
+	}
+
+	// First call of a pre-parsed lambda: parses and compiles its body.
+	void compile_lazy(func* f, proc& p)
+	{
+		std::unique_lock<std::shared_mutex> lock(procs_lock);
+		if (p.ready.load(std::memory_order_relaxed)) return;
+		compile_body(f, p);
+		p.ready.store(true, std::memory_order_release);
+	}
+
+	code compile_block(body_* b, fn_scope& fs)
+	{
+		fs.blocks.emplace_back();
+		size_t const first = fs.slots;
+		for (auto stmt : b->stmts)
+		{
+			if (stmt->type == ast::ast_type::assign) declare(fs, reinterpret_cast<assign*>(stmt)->sym_id);
+			if (stmt->type == ast::ast_type::for_loop) declare(fs, reinterpret_cast<for_loop*>(stmt)->sym_id);
+		}
+		size_t const last = fs.slots;
+		bool const global = fs.is_module;
+
+		std::vector<code> stmts;
+		for (auto stmt : b->stmts)
+		{
+			stmts.push_back(compile(stmt, fs));
+		}
+		fs.blocks.pop_back();
+
+		return [stmts, first, last, global](frame& f) -> ast*
+		{
+			auto& slots = global ? f.globals->slots : f.slots;
+			ast* res = nullptr;
+			auto const sz = stmts.size();
+			for (size_t i = 0; i < sz; ++i)
 			{
+				res = stmts[i](f);
+				if (i != sz - 1)
+				{
+					f.mem->safepoint();
+				}
 			}
-			break;
-		case ast::ast_type::func:
+			std::fill(std::begin(slots) + first, std::begin(slots) + last, nullptr);
+			if (!global) f.bound.update(first, last, false);
+			return res;
+		};
+	}
+
+	code compile(ast* node, fn_scope& fs)
+	{
+		switch (node->type)
+		{
+		case ast::ast_type::body:
+			return compile_block(reinterpret_cast<body_*>(node), fs);
+		case ast::ast_type::assign:
 			{
-				ctx.back().return_object = node;
+				auto a = reinterpret_cast<assign*>(node);
+				auto v = compile(a->v, fs);
+				auto target = resolve_local(fs, a->sym_id);
+				return [v, target](frame& f) -> ast*
+				{
+					auto val = v(f);
+					bind(f, target, val);
+					return nullptr;
+				};
+			}
+		case ast::ast_type::call:
+			{
+				auto c = reinterpret_cast<call_*>(node);
+				auto src = compile(c->src, fs);
+				std::vector<code> args;
+				for (auto a : c->as)
+				{
+					args.push_back(compile(a, fs));
+				}
+				auto site = std::make_shared<call_site>();
+				return [this, src, args, site](frame& f) -> ast*
+				{
+					auto callee = src(f);
+					if (callee != nullptr && callee->type == ast::ast_type::native)
+					{
+						auto const base = f.mem->roots.size();
+						for (auto& a : args)
+						{
+							f.mem->roots.push_back(a(f));
+						}
+						std::vector<ast*> as(std::begin(f.mem->roots) + base, std::end(f.mem->roots));
+						f.mem->roots.resize(base);
+						return reinterpret_cast<native*>(callee)->fn(*f.mem, as);
+					}
+					if (callee == nullptr || callee->type != ast::ast_type::func)
+					{
+						return nullptr;
+					}
+					auto fn = reinterpret_cast<func*>(callee);
+					auto e = site->entry.load(std::memory_order_acquire);
+					if (e == nullptr || e->first != fn)
+					{
+						std::shared_lock<std::shared_mutex> lock(procs_lock);
+						e = &*procs.find(fn);
+						site->entry.store(e, std::memory_order_release);
+					}
+					auto p = &e->second;
+					if (!p->ready.load(std::memory_order_acquire)) compile_lazy(fn, *p);
+					auto const base = f.mem->roots.size();
+					bool const kernel = fn->kernel.load(std::memory_order_relaxed) != nullptr;
+					if (kernel)
+					{
+						for (auto& a : args)
+						{
+							f.mem->roots.push_back(a(f));
+						}
+						if (ast* res = nullptr; run_kernel(fn, *f.mem, f.mem->roots.data() + base, args.size(), res))
+						{
+							f.mem->roots.resize(base);
+							return res;
+						}
+					}
+					auto const slots = std::max(p->slots, args.size());
+					frame callee_frame{ std::vector<ast*>(slots, nullptr), f.globals, f.mem, &f, &p->names, slot_bits(slots, std::min(p->params, args.size())) };
+					f.mem->enter_scope(frame_bytes(callee_frame));
+					f.mem->frames.push_back(&callee_frame.slots);
+					for (size_t i = 0; i < args.size(); ++i)
+					{
+						callee_frame.slots[i] = kernel ? f.mem->roots[base + i] : args[i](f);
+					}
+					f.mem->roots.resize(base);
+					note_arguments(fn, callee_frame.slots.data(), args.size());
+					std::fill(std::begin(callee_frame.slots) + std::min(p->params, args.size()), std::begin(callee_frame.slots) + args.size(), nullptr);
+					auto res = p->body(callee_frame);
+					f.mem->frames.pop_back();
+					f.mem->leave_scope(frame_bytes(callee_frame));
+					note_result(fn, res);
+					return res;
+				};
+			}
+		case ast::ast_type::for_loop:
+			{
+				auto fr = reinterpret_cast<for_loop*>(node);
+				auto rng = compile(fr->rng, fs);
+				declare(fs, fr->sym_id);
+				auto target = resolve_local(fs, fr->sym_id);
+				auto b = compile(fr->b, fs);
+				if (fr->parallel)
+				{
+					return [this, rng, target, b](frame& f) -> ast*
+					{
+						return run_parallel(f, rng(f), target, b);
+					};
+				}
+				return [rng, target, b](frame& f) -> ast*
+				{
+					auto r = rng(f);
+					f.mem->roots.push_back(r);
+					value_iterator it(r);
+					for (ast* v = nullptr; it.next(*f.mem, v);)
+					{
+						bind(f, target, v);
+						b(f);
+						f.mem->safepoint();
+					}
+					f.mem->roots.pop_back();
+					return nullptr;
+				};
 			}
-			break;
-		case ast::ast_type::ite:
+		case ast::ast_type::func:
 			{
+				auto fn = reinterpret_cast<func*>(node);
+				compile_func(fn);
+				return [fn](frame&) -> ast* { return fn; };
 			}
-			break;
 		case ast::ast_type::number:
 			{
-				ctx.back().return_object = new data_num(atof(reinterpret_cast<num*>(node)->n.c_str()));
+				auto n = constant<data_num>(atof(reinterpret_cast<num*>(node)->n.c_str()));
+				return [n](frame&) { return n; };
 			}
-			break;
 		case ast::ast_type::string:
 			{
-				ctx.back().return_object = new data_str(reinterpret_cast<str*>(node)->s);
+				ast* s = reinterpret_cast<str*>(node)->value();
+				return [s](frame&) { return s; };
 			}
-			break;
 		case ast::ast_type::symbol:
 			{
-				if (auto e = get(reinterpret_cast<sym*>(node)->s); e != nullptr)
+				auto const name = reinterpret_cast<sym*>(node)->sym_id;
+				auto chain = resolve(fs, name);
+				if (!fs.is_module && locals.count(name))
 				{
-					eval(e);
+					return [chain, name](frame& f) -> ast*
+					{
+						for (size_t i = 0; i + 1 < chain.size(); ++i)
+						{
+							auto const r = chain[i];
+							if (r.global ? at(f, r) != nullptr : is_bound(f, r.index)) return at(f, r);
+						}
+						if (ast* v = nullptr; caller_binding(f, name, v)) return v;
+						return at(f, chain.back());
+					};
 				}
-			}
-			break;
-		case ast::ast_type::operation:
-			{
-				auto o = reinterpret_cast<operation*>(node);
-				eval(o->l);
-				auto l = ctx.back().return_object;
-				eval(o->r);
-				auto r = ctx.back().return_object;
-				ctx.back().return_object = nullptr;
-				
-				if (l->type == r->type)
+				if (chain.size() == 1)
 				{
-					if (l->type == ast::ast_type::data_num)
-					{
-						ctx.back().return_object = l;
-						if      (o->op == "+") reinterpret_cast<data_num*>(l)->value += reinterpret_cast<data_num*>(r)->value;
-						else if (o->op == "-") reinterpret_cast<data_num*>(l)->value -= reinterpret_cast<data_num*>(r)->value;
-						else if (o->op == "*") reinterpret_cast<data_num*>(l)->value *= reinterpret_cast<data_num*>(r)->value;
-						else if (o->op == "/") reinterpret_cast<data_num*>(l)->value /= reinterpret_cast<data_num*>(r)->value;
-						delete r;
-					}
-					else if (l->type == ast::ast_type::data_str)
-					{
-						ctx.back().return_object = l;
-						if (o->op == "+") reinterpret_cast<data_str*>(l)->value += reinterpret_cast<data_str*>(r)->value;
-						delete r;
-					}
+					auto const r = chain[0];
+					if (r.global) return [i = r.index](frame& f) { return f.globals->slots[i]; };
+					return [i = r.index](frame& f) { return f.slots[i]; };
 				}
-				else
+				return [chain](frame& f) -> ast*
 				{
-					if (l->type == ast::ast_type::data_str && r->type == ast::ast_type::data_num)
+					for (auto r : chain)
 					{
-						ctx.back().return_object = l;
-						if (o->op == "+") reinterpret_cast<data_str*>(l)->value += reinterpret_cast<data_num*>(r)->to_string();
-						delete r;
+						if (r.global ? at(f, r) != nullptr : is_bound(f, r.index)) return at(f, r);
 					}
-					if (r->type == ast::ast_type::data_str && l->type == ast::ast_type::data_num)
-					{
-						ctx.back().return_object = r;
-						auto s = reinterpret_cast<data_str*>(r);
-						if (o->op == "+") s->value = reinterpret_cast<data_num*>(l)->to_string() + s->value;
-						delete l;
-					}
-				}
+					return nullptr;
+				};
 			}
-			break;
-		case ast::ast_type::data_num:
-			ctx.back().return_object = new data_num(reinterpret_cast<data_num*>(node)->value);
-			break;
-		case ast::ast_type::data_obj:
-			break;
-		case ast::ast_type::data_str:
-			ctx.back().return_object = new data_str(reinterpret_cast<data_str*>(node)->value);
-			break;
-		case ast::ast_type::data_vec:
-			break;
+		case ast::ast_type::operation:
+			return compile_operation(reinterpret_cast<operation*>(node), fs);
 		default:
-			break;
+			return [](frame&) -> ast* { return nullptr; };
 		}
 	}
 
-	std::vector<block_context> ctx;
+	static size_t frame_bytes(frame const& f)
+	{
+		return sizeof(frame) + f.slots.size() * sizeof(ast*);
+	}
 
-private:
-	
-	ast* get(std::string const& key)
+	// Each chunk of a `par for` runs on copies of the current and module
+	// frames, so writes to block slots stay private to the chunk.
+	ast* run_parallel(frame& f, ast* r, slot_ref target, code const& b) const
 	{
-		if (ctx.empty()) add_module("main");
-		ast* res = nullptr;
-		for (size_t i = ctx.size() - 1; ; --i)
+		value_iterator it(r);
+		bool const module_level = &f == f.globals;
+		auto res = parallel_map(*f.mem, it.n, [&](heap& mem, size_t lo, size_t hi, std::vector<ast*>& out)
 		{
-			if (ctx[i].block_scope.has(key))
+			frame globals{ f.globals->slots, nullptr, &mem, nullptr, f.globals->names };
+			globals.globals = &globals;
+			frame local{ module_level ? std::vector<ast*>() : f.slots, &globals, &mem, f.caller, f.names, f.bound };
+			auto& w = module_level ? globals : local;
+			mem.enter_scope(frame_bytes(globals) + frame_bytes(local), 2);
+			mem.frames.push_back(&globals.slots);
+			mem.frames.push_back(&local.slots);
+			mem.launch = [this, &globals](func* fn) { return launcher(globals, fn); };
+			for (size_t k = lo; k < hi; ++k)
 			{
-				res = ctx[i].block_scope.get(key);
-				break;
+				bind(w, target, it.at(mem, k));
+				out.push_back(b(w));
+				mem.safepoint();
 			}
-			if (i == 0)
+			mem.launch = nullptr;
+			mem.frames.resize(1);
+			mem.leave_scope(frame_bytes(globals) + frame_bytes(local), 2);
+		});
+		if (it.n != 0)
+		{
+			f.mem->roots.push_back(res);
+			bind(f, target, it.at(*f.mem, it.n - 1));
+			f.mem->roots.pop_back();
+		}
+		return res;
+	}
+
+	code compile_operation(operation* o, fn_scope& fs)
+	{
+		if (o->op == "." && o->r->type == ast::ast_type::symbol)
+		{
+			auto l = compile(o->l, fs);
+			auto& key = reinterpret_cast<sym*>(o->r)->s;
+			auto& ic = o->ic;
+			return [l, &key, &ic](frame& f) -> ast*
 			{
-				break;
+				auto v = l(f);
+				if (v == nullptr || v->type != ast::ast_type::data_obj) return nullptr;
+				return load_property(ic, reinterpret_cast<data_obj*>(v), key);
+			};
+		}
+		using num_fn = double(*)(double, double);
+		num_fn fn = nullptr;
+		if      (o->op == "+") fn = [](double a, double b) { return a + b; };
+		else if (o->op == "-") fn = [](double a, double b) { return a - b; };
+		else if (o->op == "*") fn = [](double a, double b) { return a * b; };
+		else if (o->op == "/") fn = [](double a, double b) { return a / b; };
+		else if (o->op == "<") fn = [](double a, double b) { return a < b ? 1.0 : 0.0; };
+		else if (o->op == ">") fn = [](double a, double b) { return a > b ? 1.0 : 0.0; };
+		else if (o->op == "~") fn = [](double a, double b) { return a == b ? 1.0 : 0.0; };
+		auto const& op = o->op;
+		auto l = compile(o->l, fs);
+		auto r = compile(o->r, fs);
+
+		return [l, r, fn, op](frame& f) -> ast*
+		{
+			auto lv = l(f);
+			f.mem->roots.push_back(lv);
+			auto rv = r(f);
+			f.mem->roots.pop_back();
+			if (fn != nullptr && lv != nullptr && rv != nullptr
+				&& lv->type == ast::ast_type::data_num && rv->type == ast::ast_type::data_num)
+			{
+				return f.mem->make<data_num>(fn(reinterpret_cast<data_num*>(lv)->value, reinterpret_cast<data_num*>(rv)->value));
+			}
+			return apply_operation(*f.mem, op, lv, rv);
+		};
+	}
+};
+
+// Host-side copy of a script value that does not depend on any heap. Lists
+// also stand for arrays and ranges; functions come back as null.
+static value value_of(ast* v)
+{
+	if (v == nullptr) return {};
+	switch (v->type)
+	{
+	case ast::ast_type::data_num:
+		return value(reinterpret_cast<data_num*>(v)->value);
+	case ast::ast_type::data_str:
+		return value(reinterpret_cast<data_str*>(v)->str());
+	case ast::ast_type::data_vec:
+		{
+			std::vector<value> vs;
+			for (auto e : reinterpret_cast<data_vec*>(v)->value)
+			{
+				vs.push_back(value_of(e));
 			}
+			return value::list(std::move(vs));
 		}
-		return res;
+	case ast::ast_type::data_arr:
+		{
+			auto& a = reinterpret_cast<data_arr*>(v)->value;
+			return value::list(std::vector<value>(std::begin(a), std::end(a)));
+		}
+	case ast::ast_type::data_rng:
+		{
+			auto r = reinterpret_cast<data_rng*>(v);
+			std::vector<value> vs;
+			for (size_t i = 0, n = r->size(); i < n; ++i)
+			{
+				vs.push_back(value(r->start + static_cast<double>(i) * r->step));
+			}
+			return value::list(std::move(vs));
+		}
+	case ast::ast_type::data_obj:
+		{
+			auto o = reinterpret_cast<data_obj*>(v);
+			std::vector<std::pair<std::string, value>> fs;
+			for (size_t i = 0; i < o->slots.size(); ++i)
+			{
+				fs.push_back({ o->shp->keys[i], value_of(o->slots[i]) });
+			}
+			return value::object(std::move(fs));
+		}
+	default:
+		return {};
 	}
-	void set(std::string const& key, ast* value)
+}
+
+// Allocates v in mem; nothing in between may reach a safepoint.
+static ast* make_data(heap& mem, value const& v)
+{
+	switch (v.type())
 	{
-		if (ctx.empty()) add_module("main");
-		ctx.back().block_scope.set(key, value);
+	case value::kind::number:
+		return mem.make<data_num>(v.as_number());
+	case value::kind::string:
+		return mem.make<data_str>(v.as_string());
+	case value::kind::list:
+		{
+			std::vector<ast*> vs;
+			for (auto& e : v.as_list())
+			{
+				vs.push_back(make_data(mem, e));
+			}
+			return mem.make<data_vec>(vs);
+		}
+	case value::kind::object:
+		{
+			auto shp = shape::root();
+			std::vector<ast*> slots;
+			for (auto& [key, f] : v.as_object())
+			{
+				if (auto const slot = shp->find(key); slot != shape::npos)
+				{
+					slots[slot] = make_data(mem, f);
+					continue;
+				}
+				shp = shp->with_key(key);
+				slots.push_back(make_data(mem, f));
+			}
+			return mem.make<data_obj>(shp, slots);
+		}
+	default:
+		return nullptr;
 	}
-	void add_module(std::string const& module_name)
+}
+
+// Embedded scripts are parsed with the default grammar.
+static grammar const& default_grammar()
+{
+	static grammar const g;
+	return g;
+}
+
+struct prepared_program::compiled
+{
+	parse_tree tree;
+	closure_compiler cc;
+};
+
+prepared_program::prepared_program() = default;
+prepared_program::~prepared_program() = default;
+
+std::shared_ptr<prepared_program const> prepared_program::compile(std::string_view source)
+{
+	std::istringstream in{ std::string(source) };
+	std::shared_ptr<prepared_program> p(new prepared_program());
+	p->impl.reset(new compiled{ parse_tree::parse(default_grammar(), in), {} });
+	if (p->success())
+	{
+		p->impl->cc.compile_program(p->impl->tree.root);
+	}
+	return p;
+}
+
+bool prepared_program::success() const
+{
+	auto& tree = impl->tree;
+	return tree.success && tree.root != nullptr && tree.stopped_at == parse_tree::npos;
+}
+
+size_t prepared_program::error_offset() const
+{
+	if (success()) return npos;
+	return impl->tree.stopped_at == parse_tree::npos ? 0 : impl->tree.stopped_at;
+}
+
+size_t prepared_program::global(std::string const& name) const
+{
+	return success() ? impl->cc.global_slot_of(symbol_id(name)) : npos;
+}
+
+value prepared_program::run(std::vector<std::pair<size_t, value>> const& inputs, size_t heap_limit, mem_report* usage) const
+{
+	if (!success()) return {};
+	task_group tasks;
+	heap mem;
+	mem.heap_limit = heap_limit;
+	mem.tasks = &tasks;
+	struct report_usage
+	{
+		heap& mem;
+		mem_report* usage;
+		~report_usage()
+		{
+			if (usage != nullptr) *usage = mem.memory;
+		}
+	} on_exit{ mem, usage };
+	std::vector<std::pair<size_t, ast*>> bound;
+	for (auto& [slot, v] : inputs)
+	{
+		if (slot != npos) bound.push_back({ slot, make_data(mem, v) });
+	}
+	auto res = value_of(impl->cc.run(mem, bound));
+	tasks.finish();
+	return res;
+}
+
+script_editor::script_editor(std::string source) : file(new source_file(default_grammar(), std::move(source)))
+{
+}
+
+script_editor::~script_editor() = default;
+
+void script_editor::edit(size_t offset, size_t removed, std::string_view inserted)
+{
+	file->edit(offset, removed, inserted);
+}
+
+std::string const& script_editor::source() const
+{
+	return file->source();
+}
+
+bool script_editor::success() const
+{
+	return file->success();
+}
+
+std::string script_editor::tree() const
+{
+	return file->success() ? file->tree()->to_string() : std::string();
+}
+
+std::string parsed_tree(std::string_view source)
+{
+	std::istringstream in{ std::string(source) };
+	auto const t = parse_tree::parse(default_grammar(), in);
+	if (!t.success) return {};
+	return t.root == nullptr ? std::string("null") : t.root->to_string();
+}
+
+template <typename F>
+double bench_us(int runs, F&& f)
+{
+	auto const start = std::chrono::steady_clock::now();
+	for (int i = 0; i < runs; ++i)
+	{
+		f();
+	}
+	std::chrono::duration<double, std::micro> const spent = std::chrono::steady_clock::now() - start;
+	return spent.count() / runs;
+}
+
+void print_gc_stats(gc_stats const& st)
+{
+	std::ostringstream line;
+	line << "gc: " << st.minor_collections << " minor, " << st.major_collections << " major, "
+		<< st.allocated_objects << " allocated, " << st.freed_objects << " freed, "
+		<< st.peak_bytes << " peak bytes, "
+		<< st.total_pause_us << " us total pause, " << st.max_pause_us << " us max pause\n";
+	std::cerr << line.str();
+}
+
+void print_mem_stats(char const* title, mem_report const& r)
+{
+	std::ostringstream lines;
+	lines << "memory (" << title << "): kind, live bytes, peak bytes, live objects, total objects\n";
+	for (size_t k = 0; k < r.size(); ++k)
+	{
+		if (r[k].total_objects == 0 && r[k].peak_bytes == 0) continue;
+		lines << "  " << mem_kind_names[k] << ": " << r[k].live_bytes << ", " << r[k].peak_bytes << ", "
+			<< r[k].live_objects << ", " << r[k].total_objects << "\n";
+	}
+	std::cerr << lines.str();
+}
+
+void print_opt_stats(optimizer::report const& r)
+{
+	std::ostringstream line;
+	line << "opt: " << r.inlined_calls << " calls inlined, " << r.removed_statements << " dead statements removed, "
+		<< r.hoisted_expressions << " invariants hoisted\n";
+	std::cerr << line.str();
+}
+
+void print_pool_stats(ast_pool const& pool)
+{
+	static char const* const kinds[] = { "symbol", "number", "string", "operation" };
+	auto const st = pool.stats();
+	std::ostringstream lines;
+	lines << "hash-cons: kind, nodes, unique, nodes per unique\n";
+	for (size_t k = 0; k < st.size(); ++k)
+	{
+		lines << "  " << kinds[k] << ": " << st[k].nodes << ", " << st[k].unique << ", "
+			<< (st[k].unique != 0 ? static_cast<double>(st[k].nodes) / st[k].unique : 0.0) << "\n";
+	}
+	std::cerr << lines.str();
+}
+
+std::string type_names(uint32_t mask)
+{
+	std::string names;
+	for (size_t k = 0; k < 32; ++k)
+	{
+		if ((mask & (1u << k)) == 0) continue;
+		if (!names.empty()) names += '|';
+		names += k == 0 ? "null" : mem_kind_names[k];
+	}
+	return names.empty() ? "-" : names;
+}
+
+// Type feedback of the funcs bound at the top level of root.
+void print_profile(ast* root)
+{
+	if (root == nullptr || root->type != ast::ast_type::body) return;
+	static char const* const states[] = { "profiling", "compiled", "generic" };
+	std::ostringstream lines;
+	lines << "profile: func, profiled calls, argument types, result types, state\n";
+	for (auto stmt : reinterpret_cast<body_*>(root)->stmts)
 	{
-		ctx.push_back(block_context{ module_name });
+		if (stmt->type != ast::ast_type::assign) continue;
+		auto a = reinterpret_cast<assign*>(stmt);
+		if (a->v == nullptr || a->v->type != ast::ast_type::func) continue;
+		auto& fb = reinterpret_cast<func*>(a->v)->profile;
+		lines << "  " << a->id << ": " << fb.calls.load() << ", (";
+		for (size_t i = 0; i < reinterpret_cast<func*>(a->v)->as.size() && i < type_feedback::max_args; ++i)
+		{
+			lines << (i == 0 ? "" : ", ") << type_names(fb.args[i].load());
+		}
+		auto const k = reinterpret_cast<func*>(a->v)->kernel.load();
+		lines << "), " << type_names(fb.result.load()) << ", " << (k != nullptr && k->native.load() != nullptr ? "native" : states[static_cast<int>(fb.status.load())]) << "\n";
 	}
+	std::cerr << lines.str();
+}
+
+void print_jit_stats(jit_stats const& s)
+{
+	std::cerr << "jit: " << s.compiled.load() << " kernels in machine code, " << s.checked.load() << " calls checked, " << s.mismatched.load() << " mismatched" << std::endl;
+}
+
+struct run_options
+{
+	bool closures{ false };
+	bool gc_stats{ false };
+	bool mem_stats{ false };
+	bool optimize{ false };
+	bool opt_stats{ false };
+	bool profile{ false };
+	bool pool_stats{ false };
+	optimizer::passes passes;
+	int bench{ 0 };
+	size_t nursery{ 0 };
+	size_t heap_limit{ 0 };
+	std::string save_snapshot;
+	snapshot const* preload{ nullptr };
 };
 
-int main()
+int run_script(grammar const& g, std::string const& path, run_options const& opt, out_buffer& out)
 {
-	//auto env = new Env(std::cin, std::cout, std::cerr);
-	if (std::ifstream file("main.txt"); file.is_open())
+	std::ifstream file(path);
+	if (!file.is_open())
 	{
-		chars_in_file chars(file);
-		lex lexer(chars);
-		lex_buff lexer_b(lexer);
-		parser p(lexer_b);
+		std::cerr << "cannot open " + path + "\n";
+		return 1;
+	}
+	auto tree = parse_tree::parse(g, file);
+	out << (tree.success ? "1\n" : "0\n");
+	if (!tree.success || tree.root == nullptr)
+	{
+		return 0;
+	}
 
-		par_res res = p();
-		std::cout << res.success << std::endl;
+	auto root = tree.root;
+	if (opt.optimize)
+	{
+		optimizer o;
+		o.enabled = opt.passes;
+		auto const st = o.run(root);
+		if (opt.opt_stats) print_opt_stats(st);
+	}
+	closure_compiler cc;
+	cc.compile_program(root, opt.preload != nullptr ? opt.preload->globals : decltype(snapshot::globals){});
 
-		if (res.success && !res.result.empty())
+	// Declared after the tree and the compiler, so that tasks still parked
+	// when a run fails are cancelled before what they run goes away.
+	task_group tasks;
+
+	auto configure = [&opt, &tasks](heap& mem)
+	{
+		if (opt.nursery != 0) mem.nursery_limit = opt.nursery;
+		mem.heap_limit = opt.heap_limit;
+		mem.tasks = &tasks;
+	};
+	auto report = [&out, &opt, &tree](ast* ret, heap& mem)
+	{
+		if (ret != nullptr)
+		{
+			ret->write(out);
+			out << '\n';
+		}
+		out.flush();
+		if (opt.gc_stats) print_gc_stats(mem.stats);
+		if (opt.mem_stats)
+		{
+			print_mem_stats("front end", front_end_memory());
+			print_mem_stats("run", mem.memory);
+		}
+		if (opt.profile) print_profile(tree.root);
+		if (native_stats().verify) print_jit_stats(native_stats());
+		if (opt.pool_stats && tree.pool != nullptr) print_pool_stats(*tree.pool);
+		if (opt.bench > 0 && ret != nullptr)
+		{
+			out_buffer sink;
+			auto const write_us = bench_us(opt.bench, [ret, &sink]
+			{
+				sink.take();
+				ret->write(sink);
+			});
+			std::cerr << "output:      " << sink.size() / write_us << " MB/s" << std::endl;
+		}
+	};
+
+	try
+	{
+		if (opt.closures && opt.save_snapshot.empty())
+		{
+			heap mem;
+			configure(mem);
+			auto ret = cc.run(mem);
+			tasks.finish();
+			report(ret, mem);
+		}
+		else
 		{
 			evaluator ev;
-			ev.ctx.push_back({"main"});
-			ev.eval(res.result.back());
-			if (!ev.ctx.empty())
+			configure(ev.mem);
+			ev.add_module("main");
+			if (opt.preload != nullptr) ev.restore(*opt.preload);
+			if (opt.save_snapshot.empty())
+			{
+				ev.eval(root);
+			}
+			else
 			{
-				std::cout << ev.ctx.back().return_object->to_string() << std::endl;
+				ev.eval_module(root);
+				snapshot::save(opt.save_snapshot, ev.ctx.front().block_scope.entries());
 			}
-			//std::cout << "\n" << res.result.back()->to_string() << std::endl;
+			tasks.finish();
+			report(ev.ctx.empty() ? nullptr : ev.ctx.back().return_object, ev.mem);
 		}
-
-		//eval_list(parse(lexer));
 	}
+	catch (heap_exhausted const& e)
+	{
+		out.flush();
+		std::cerr << std::string(e.what()) + "\n";
+		return 1;
+	}
+	catch (syntax_error const& e)
+	{
+		out.flush();
+		std::cerr << std::string(e.what()) + "\n";
+		return 1;
+	}
+	catch (snapshot_error const& e)
+	{
+		out.flush();
+		std::cerr << std::string(e.what()) + "\n";
+		return 1;
+	}
+	//std::cout << "\n" << res.result.back()->to_string() << std::endl;
+
+	if (opt.bench > 0)
+	{
+		auto const tree_us = bench_us(opt.bench, [root, &opt]
+		{
+			task_group tasks;
+			evaluator ev;
+			ev.mem.tasks = &tasks;
+			ev.add_module("main");
+			if (opt.preload != nullptr) ev.restore(*opt.preload);
+			ev.eval(root);
+			tasks.finish();
+		});
+		auto const closure_us = bench_us(opt.bench, [&cc]
+		{
+			task_group tasks;
+			heap mem;
+			mem.tasks = &tasks;
+			cc.run(mem);
+			tasks.finish();
+		});
+		std::cerr << "tree-walker: " << tree_us << " us/run" << std::endl;
+		std::cerr << "closures:    " << closure_us << " us/run" << std::endl;
 
+		std::ifstream again(path);
+		std::string const src{ std::istreambuf_iterator<char>(again), std::istreambuf_iterator<char>() };
+		auto const parse_us = bench_us(opt.bench, [&g, &src]
+		{
+			std::istringstream in(src);
+			parse_tree::parse(g, in);
+		});
+		source_file sf(g, src);
+		auto const mid = src.size() / 2;
+		auto const edit_us = bench_us(opt.bench, [&sf, mid]
+		{
+			sf.edit(mid, 0, " ");
+			sf.edit(mid, 1, "");
+		}) / 2;
+		std::cerr << "parse:       " << parse_us << " us/run, " << edit_us << " us/edit" << std::endl;
+	}
 	return 0;
 }
+
+int run_batch(grammar const& g, std::vector<std::string> const& paths, run_options const& opt, size_t jobs)
+{
+	struct result
+	{
+		out_buffer out;
+		int status{ 0 };
+		double ms{ 0 };
+	};
+	std::vector<result> results(paths.size());
+	auto const start = std::chrono::steady_clock::now();
+	{
+		thread_pool pool(jobs);
+		pool.parallel_for(paths.size(), [&](size_t i)
+		{
+			auto const t0 = std::chrono::steady_clock::now();
+			results[i].status = run_script(g, paths[i], opt, results[i].out);
+			std::chrono::duration<double, std::milli> const spent = std::chrono::steady_clock::now() - t0;
+			results[i].ms = spent.count();
+		});
+	}
+	std::chrono::duration<double, std::milli> const total = std::chrono::steady_clock::now() - start;
+
+	out_buffer out(std::cout);
+	int status = 0;
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		out << "== " << paths[i] << " (" << results[i].ms << " ms";
+		if (results[i].status != 0) out << ", failed";
+		out << ")\n" << std::string_view(results[i].out.take());
+		status = std::max(status, results[i].status);
+	}
+	out << "== " << static_cast<double>(paths.size()) << " scripts on " << static_cast<double>(jobs) << " threads in " << total.count() << " ms\n";
+	return status;
+}
+
+int aynana_main(int argc, char* argv[])
+{
+	std::vector<std::string> paths;
+	run_options opt;
+	bool batch = false;
+	bool lazy = false;
+	bool hash_cons = false;
+	std::unique_ptr<snapshot> preload;
+	size_t jobs = thread_pool::hardware_threads();
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string const arg = argv[i];
+		if (arg == "--closures") opt.closures = true;
+		else if (arg == "--gc-stats") opt.gc_stats = true;
+		else if (arg == "--mem-stats") opt.mem_stats = true;
+		else if (arg == "--opt-stats") opt.opt_stats = true;
+		else if (arg == "--profile") opt.profile = true;
+		else if (arg == "--no-kernels") numeric_kernels = false;
+		else if (arg == "--no-jit") native_code = false;
+		else if (arg == "--jit-verify") native_stats().verify = true;
+		else if (arg == "--optimize") opt.optimize = true;
+		else if (arg.rfind("--optimize=", 0) == 0)
+		{
+			opt.optimize = true;
+			auto const list = "," + arg.substr(11) + ",";
+			opt.passes.inline_calls = list.find(",inline,") != std::string::npos;
+			opt.passes.dead_code = list.find(",dce,") != std::string::npos;
+			opt.passes.hoist = list.find(",hoist,") != std::string::npos;
+		}
+		else if (arg == "--batch") batch = true;
+		else if (arg == "--lazy") lazy = true;
+		else if (arg == "--hash-cons") hash_cons = true;
+		else if (arg == "--hash-cons-stats") opt.pool_stats = true;
+		else if (arg.rfind("--save-snapshot=", 0) == 0) opt.save_snapshot = arg.substr(16);
+		else if (arg.rfind("--snapshot=", 0) == 0)
+		{
+			try
+			{
+				preload = snapshot::load(arg.substr(11));
+			}
+			catch (snapshot_error const& e)
+			{
+				std::cerr << std::string(e.what()) + "\n";
+				return 1;
+			}
+			opt.preload = preload.get();
+		}
+		else if (arg.rfind("--bench=", 0) == 0) opt.bench = atoi(arg.c_str() + 8);
+		else if (arg.rfind("--nursery=", 0) == 0) opt.nursery = strtoull(arg.c_str() + 10, nullptr, 10);
+		else if (arg.rfind("--heap-limit=", 0) == 0) opt.heap_limit = strtoull(arg.c_str() + 13, nullptr, 10);
+		else if (arg.rfind("--jobs=", 0) == 0) jobs = std::max<size_t>(strtoull(arg.c_str() + 7, nullptr, 10), 1);
+		else if (arg.rfind("--manifest=", 0) == 0)
+		{
+			batch = true;
+			std::ifstream manifest(arg.substr(11));
+			for (std::string line; std::getline(manifest, line);)
+			{
+				if (!line.empty() && line.back() == '\r') line.pop_back();
+				if (!line.empty()) paths.push_back(line);
+			}
+		}
+		else paths.push_back(arg);
+	}
+
+	//auto env = new Env(std::cin, std::cout, std::cerr);
+	grammar const g(lazy, hash_cons);
+	if (batch)
+	{
+		return run_batch(g, paths, opt, jobs);
+	}
+	out_buffer out(std::cout);
+	return run_script(g, paths.empty() ? "main.txt" : paths.back(), opt, out);
+}
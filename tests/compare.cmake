@@ -0,0 +1,34 @@
+# Runs SCRIPT with BIN once per mode in MODES (flag sets split by '|', "-" for
+# none) and fails unless every run prints what the first one did and, when
+# EXPECT names a file, what that file holds. A run given --jit-verify must
+# have checked some machine-code calls and found no mismatch.
+string(REPLACE "|" ";" modes "${MODES}")
+unset(first)
+if(DEFINED EXPECT)
+	file(READ "${EXPECT}" expected)
+endif()
+foreach(mode IN LISTS modes)
+	set(flags "")
+	if(NOT mode STREQUAL "-")
+		separate_arguments(flags UNIX_COMMAND "${mode}")
+	endif()
+	execute_process(COMMAND "${BIN}" ${flags} "${SCRIPT}"
+		OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE code)
+	if(mode MATCHES "--jit-verify")
+		if(NOT err MATCHES "jit: [^\n]* [1-9][0-9]* calls checked, 0 mismatched\n")
+			message(FATAL_ERROR "${SCRIPT}: '${mode}' reported\n${err}")
+		endif()
+		string(REGEX REPLACE "jit: [^\n]*\n" "" err "${err}")
+	endif()
+	if(DEFINED EXPECT AND NOT out STREQUAL expected)
+		message(FATAL_ERROR "${SCRIPT}: '${mode}' printed\n${out}instead of\n${expected}")
+	endif()
+	set(out "${out}${err}exit ${code}\n")
+	if(NOT DEFINED first)
+		set(first "${out}")
+		set(first_mode "${mode}")
+	elseif(NOT out STREQUAL first)
+		message(FATAL_ERROR "${SCRIPT}: '${mode}' differs from '${first_mode}'\n"
+			"--- ${first_mode}\n${first}--- ${mode}\n${out}")
+	endif()
+endforeach()
@@ -0,0 +1,39 @@
+# Writes a random numeric script: a few lambdas of arithmetic and comparisons
+# called often enough to be compiled to machine code, then from par for.
+# usage: python3 generate.py SEED > kernels_SEED.txt
+import random, sys
+seed = int(sys.argv[1]); random.seed(seed)
+ops = ['+','-','*','/','<','>','~']
+def expr(d, vs):
+    if d <= 0 or random.random() < 0.25:
+        return random.choice([str(random.randint(0, 9)), str(random.randint(0, 99) / 8), random.choice(vs)])
+    return f"({expr(d-1, vs)} {random.choice(ops)} {expr(d-1, vs)})"
+out = []
+fs = []
+for i in range(random.randint(1, 3)):
+    ps = random.sample(['x','y','p','q'], random.randint(1, 4))
+    vs = list(ps)
+    body = []
+    for j in range(random.randint(0, 6)):
+        l = f"t{j}"
+        body.append(f"{l} = {expr(3, vs)}")
+        vs.append(l)
+    body.append(expr(4, vs))
+    out.append(f"f{i} = \\ {', '.join(ps)} {{ {'; '.join(body)} }}")
+    fs.append((f"f{i}", len(ps)))
+res = []
+for f, ar in fs:
+    def arg():
+        r = random.random()
+        if r < 0.01: return '"s"'
+        if r < 0.6: return 'i'
+        if r < 0.8: return '(i / 7)'
+        return str(random.randint(0, 9))
+    n = random.choice([1100, 1500, 2500])
+    call = f"{f}({', '.join(arg() for _ in range(ar))})"
+    # a plain loop first, so the kernel reaches machine code however the
+    # par for below is scheduled
+    out.append(f"for i : range(1100) {{ {call} }}")
+    out.append(f"r{f} = par for i : range({n}) {{ {call} }}")
+    res.append(f'"{f}", r{f}')
+print(";\n".join(out) + ";\nobject(" + ", ".join(res) + ")")
@@ -0,0 +1,107 @@
+// Applies random edits to a script_editor and checks after each one that it
+// holds the tree a fresh parse of the same text gives.
+// usage: source_file_edits script...
+#include "aynana.h"
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+
+struct edit_case
+{
+	size_t offset;
+	size_t removed;
+	std::string inserted;
+};
+
+// Mostly whole tokens and statements, so the text keeps parsing often.
+static edit_case random_edit(std::mt19937& rng, std::string const& text)
+{
+	static std::string const pieces[]{ " ", "x", "y1", "0", "2.5", "\"s\"", "+", " * ", "<", ";", "(", ")", "{", "}",
+		", ", "a = 1;", "x = x + 1;", "\\ a { a };", "f(1, 2);", "{ y1 = 3; y1 };", "if x { 1 } else { 2 };",
+		"for i : range(3) { i };", "while x < 3 { x = x + 1 };" };
+	auto pick = [&rng](size_t n) { return std::uniform_int_distribution<size_t>(0, n)(rng); };
+	edit_case e{ pick(text.size()), 0, "" };
+	switch (pick(3))
+	{
+	case 0:
+		e.removed = pick(6);
+		break;
+	case 1:
+		e.removed = pick(2);
+		[[fallthrough]];
+	default:
+		e.inserted = pieces[pick(std::size(pieces) - 1)];
+		break;
+	}
+	return e;
+}
+
+// The tree of sf must be the one a fresh parse of its text gives; a parse
+// that stops early still succeeds, so an editor that did not take every
+// statement is only held to that when the text is known to parse.
+static bool matches(script_editor const& sf, bool must_parse, std::string const& where)
+{
+	if (!sf.success() && !must_parse) return true;
+	auto const fresh = parsed_tree(sf.source());
+	auto const want = fresh.empty() ? std::string("no tree") : fresh;
+	auto const got = sf.success() ? sf.tree() : std::string("no tree");
+	if (got == want) return true;
+	std::cerr << where << "\n--- text\n" << sf.source() << "\n--- parse\n" << want << "\n--- source_file\n" << got << std::endl;
+	return false;
+}
+
+// Rounds of one to three random edits, each undone again in reverse
+// order. Returns the number of checked trees, or -1 on a mismatch.
+static long check(std::string const& name, std::string const& src, unsigned seed, size_t rounds)
+{
+	std::mt19937 rng(seed);
+	script_editor sf(src);
+	bool const parses = sf.success();
+	long checked = 0;
+	for (size_t round = 0; round < rounds; ++round)
+	{
+		std::vector<edit_case> undo;
+		for (auto n = 1 + rng() % 3; n-- > 0;)
+		{
+			auto const e = random_edit(rng, sf.source());
+			undo.push_back({ e.offset, e.inserted.size(), sf.source().substr(e.offset, e.removed) });
+			sf.edit(e.offset, e.removed, e.inserted);
+			auto const where = name + ", seed " + std::to_string(seed) + ", round " + std::to_string(round) + ": at "
+				+ std::to_string(e.offset) + " removed " + std::to_string(e.removed) + " inserted \"" + e.inserted + "\"";
+			if (!matches(sf, false, where)) return -1;
+			checked += sf.success();
+		}
+		while (!undo.empty())
+		{
+			auto const& e = undo.back();
+			sf.edit(e.offset, e.removed, e.inserted);
+			auto const where = name + ", seed " + std::to_string(seed) + ", round " + std::to_string(round) + ": undoing at "
+				+ std::to_string(e.offset);
+			undo.pop_back();
+			if (!matches(sf, parses && undo.empty(), where)) return -1;
+			checked += sf.success();
+		}
+	}
+	return checked;
+}
+
+int main(int argc, char** argv)
+{
+	int status = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::ifstream file(argv[i]);
+		std::string const src{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+		long compared = 0;
+		for (unsigned seed = 1; seed <= 20 && compared >= 0; ++seed)
+		{
+			auto const n = check(argv[i], src, seed, 100);
+			compared = n < 0 ? n : compared + n;
+		}
+		if (compared < 0) status = 1;
+		else std::cout << argv[i] << ": " << compared << " trees matched a fresh parse" << std::endl;
+	}
+	return status;
+}